@@ -1,5 +1,6 @@
-/*  temper.c - Offers sysfs entries to get measured temperatures
- *             from USB key "TEMPer2"
+/*  temper.c - Offers sysfs entries and a char device to get measured
+ *             temperatures from the USB keys of the "TEMPer" family, over
+ *             a choice of USB transports
  *
  *  Copyright (C) 2016 by Miquel Raynal
  */
@@ -10,105 +11,2569 @@
 #include "linux/usb.h"
 #include "linux/slab.h"
 #include "linux/stat.h"
+#include "linux/miscdevice.h"
+#include "linux/mutex.h"
+#include "linux/spinlock.h"
+#include "linux/workqueue.h"
+#include "linux/ktime.h"
+#include "linux/sort.h"
+#include "linux/delay.h"
+#include "linux/pm_runtime.h"
+#include "linux/completion.h"
+#include "linux/wait.h"
+#include "linux/sched.h"
+#include "linux/atomic.h"
+#include "linux/poll.h"
+#include "linux/io_uring/cmd.h"
+#include "linux/hrtimer.h"
+#include "linux/timekeeping.h"
+#include "linux/kref.h"
+#include "net/genetlink.h"
 
-#define TEMPER_VID 0x0c45
-#define TEMPER_PID 0x7401
+#include "temper_uapi.h"
+#include "temper_models.h"
+#include "temper_common.h"
 
 #define TEMPER_CTRL_REQUEST_TYPE 0x21
 #define TEMPER_CTRL_REQUEST      0x09
 #define TEMPER_CTRL_VALUE        0x0200
 #define TEMPER_CTRL_INDEX        0x0001
-#define TEMPER_CTRL_BUFFER_SIZE  0x0008
-#define TEMPER_INT_BUFFER_SIZE   0x0008
+#define TEMPER_CTRL_BUFFER_SIZE  TEMPER_REPORT_SIZE
+#define TEMPER_INT_BUFFER_SIZE   TEMPER_REPORT_SIZE
+#define TEMPER_INT_IN_EPNUM      2 /* Interrupt in EP of the sensor interface */
 
-static char temper_buf_get_temp[] = {
-	0x01, 0x80, 0x33, 0x01,
-	0x00, 0x00, 0x00, 0x00};
+/* Adaptive timeouts */
+#define TEMPER_TIMEOUT_MAX_MS    2000
+#define TEMPER_LAT_WINDOW        64 /* Latencies kept to compute the p99 */
+#define TEMPER_LAT_MIN_SAMPLES   8 /* Below, stick to the max timeout */
+
+static unsigned int timeout_floor_ms = 50;
+module_param(timeout_floor_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_floor_ms, "Lower bound of the adaptive timeout (ms)");
+
+static unsigned int timeout_mult = 4;
+module_param(timeout_mult, uint, 0644);
+MODULE_PARM_DESC(timeout_mult, "Adaptive timeout is p99 latency times this factor");
+
+static unsigned int fail_threshold = 3;
+module_param(fail_threshold, uint, 0644);
+MODULE_PARM_DESC(fail_threshold, "Consecutive failures before entering fast-fail");
+
+static unsigned int probe_interval_ms = 1000;
+module_param(probe_interval_ms, uint, 0644);
+MODULE_PARM_DESC(probe_interval_ms, "Period of the health probe while in fast-fail (ms)");
+
+/* Automatic recovery */
+#define TEMPER_RESET_WAIT_MS     5000 /* Then the reset was dropped */
+
+static unsigned int reset_threshold = 6;
+module_param(reset_threshold, uint, 0644);
+MODULE_PARM_DESC(reset_threshold, "Consecutive failures before resetting the device (0 disables)");
+
+static unsigned int reset_limit = 3;
+module_param(reset_limit, uint, 0644);
+MODULE_PARM_DESC(reset_limit, "Resets in a row without a good sample before giving up on resets (0 for no limit)");
+
+/* Per-client rate limiting */
+static unsigned int client_rate = 4;
+module_param(client_rate, uint, 0644);
+MODULE_PARM_DESC(client_rate, "USB transactions per second allowed per client (0 disables)");
+
+static unsigned int client_burst = 4;
+module_param(client_burst, uint, 0644);
+MODULE_PARM_DESC(client_burst, "Token bucket depth of each client");
+
+/* Runtime PM */
+static int autosuspend_delay_ms = 2000;
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Idle time before autosuspend (ms, negative leaves it to userspace)");
+
+/* Transports */
+#define TEMPER_NR_TRANSPORTS     3
+#define TEMPER_BENCH_MAX_RUNS    100
+#define TEMPER_DRAIN_MS          100 /* Grace for the answer to a failed request */
+
+/* Grid aligned sampling */
+#define TEMPER_GRID_MIN_MS       100
+
+static char *default_transport = "sync";
+module_param_named(transport, default_transport, charp, 0444);
+MODULE_PARM_DESC(transport, "Transport used by new devices: sync, urb or stream");
+
+/* Background sampling and netlink fan-out */
+static unsigned int sample_interval_ms;
+module_param(sample_interval_ms, uint, 0444);
+MODULE_PARM_DESC(sample_interval_ms, "Default background sampling period (ms, 0 disables)");
+
+static unsigned int nl_batch = 1;
+module_param(nl_batch, uint, 0644);
+MODULE_PARM_DESC(nl_batch, "Samples gathered in one netlink message");
+
+static unsigned int nl_batch_ms = 100;
+module_param(nl_batch_ms, uint, 0644);
+MODULE_PARM_DESC(nl_batch_ms, "Longest time a sample waits for its batch to fill (ms)");
+
+static char *model_name;
+module_param_named(model, model_name, charp, 0444);
+MODULE_PARM_DESC(model, "Model of the sticks with TEMPer2 IDs: TEMPer2, TEMPer1 or TEMPer1F");
+
+/* Memory held on behalf of the devices, see temper_alloc() */
+static atomic_long_t temper_alloc_objects = ATOMIC_LONG_INIT(0);
+static atomic_long_t temper_alloc_bytes = ATOMIC_LONG_INIT(0);
+
+static int temper_get_allocations(char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%ld objects, %ld bytes\n",
+		       atomic_long_read(&temper_alloc_objects),
+		       atomic_long_read(&temper_alloc_bytes));
+}
+
+static const struct kernel_param_ops temper_allocations_ops = {
+	.get = temper_get_allocations,
+};
+module_param_cb(allocations, &temper_allocations_ops, NULL, 0444);
+MODULE_PARM_DESC(allocations, "Memory held for the devices, back to 0 once they are all gone and closed");
+
+enum temper_health {
+	TEMPER_HEALTHY,
+	TEMPER_FAST_FAIL,
+};
+
+struct usb_temper;
+
+/*
+ * A transport fills temper_dev->report with the answer to the "get
+ * temperature" command and returns its length. init() and release()
+ * handle its resources, the optional start() and stop() the URBs kept in
+ * flight between transactions (they must not sleep on io_mutex).
+ */
+struct temper_transport {
+	const char *name;
+	int (*init)(struct usb_temper *temper_dev);
+	void (*release)(struct usb_temper *temper_dev);
+	int (*start)(struct usb_temper *temper_dev);
+	void (*stop)(struct usb_temper *temper_dev);
+	int (*xfer)(struct usb_temper *temper_dev, unsigned int timeout_ms);
+};
+
+/* Self-benchmark results of one transport */
+struct temper_bench {
+	unsigned int runs;
+	unsigned int errors;
+	unsigned int lat_min_us;
+	unsigned int lat_avg_us;
+	unsigned int lat_max_us;
+	unsigned int cpu_avg_us; /* Caller plus completion handlers */
+};
+
+/* Per open file state, sysfs readers share one */
+struct temper_client {
+	struct usb_temper *temper_dev;
+	/* Token bucket, in thousandths of a transaction */
+	unsigned int tokens;
+	ktime_t last_refill;
+	/* Accounting, protected by the device lock */
+	struct temper_client_stats stats;
+	/* Change-only delivery, protected by the device lock */
+	struct list_head node;
+	wait_queue_head_t wq;
+	struct temper_deadband deadband;
+	bool pending; /* next is waiting to be read */
+	struct temper_sample_ts next;
+	bool delivered; /* last is valid */
+	struct temper_sample_ts last;
+};
 
 /* Peripheral definition */
 struct usb_temper {
 	struct usb_device *udev;
 	struct usb_interface *interface;
+	struct miscdevice miscdev;
 	/* Ctrl out EP */
 	char *ctrl_out_buffer;
+	struct urb *ctrl_out_urb;
 	struct usb_ctrlrequest *ctrl_out_cr;
+	int ctrl_status;
 	/* Interrupt in EP */
 	char *int_in_buffer;
+	unsigned int int_in_size;
+	struct urb *int_in_urb;
 	struct usb_endpoint_descriptor *int_in_endpoint;
+	int int_status;
+	int int_length;
+	struct completion int_done;
+	/* Streaming pipeline, protected by lock */
+	bool stream_running;
+	bool stream_answer_due; /* A request gave up on an answer */
+	unsigned long stream_seq;
+	u8 stream_report[TEMPER_INT_BUFFER_SIZE];
+	u64 stream_report_ns;
+	u32 stream_report_frame;
+	wait_queue_head_t stream_wq;
+	/* Transport, changed with io_mutex held */
+	const struct temper_transport *transport;
+	u8 report[TEMPER_INT_BUFFER_SIZE];
+	u64 report_ns; /* Completion time of the report */
+	u32 report_frame; /* USB frame at completion, or TEMPER_NO_FRAME */
+	atomic64_t cb_ns; /* Time spent in completion handlers */
+	struct temper_bench bench[TEMPER_NR_TRANSPORTS];
+	bool bench_running; /* Transport in use by the benchmark */
 	/* Data */
-	unsigned int temp_in; /* m°C */
-	unsigned int temp_out; /* m°C */
+	const struct temper_model *model;
+	int temp_in; /* m°C */
+	int temp_out; /* m°C */
+	int humidity; /* m%RH */
+	bool has_sample;
+	ktime_t last_good;
+	u64 sample_ns; /* CLOCK_MONOTONIC, at report completion */
+	u64 sample_real_ns;
+	u32 sample_frame;
+	bool sample_on_grid;
+	s64 sample_grid_err_ns;
+	/* Timing statistics */
+	u64 iv_count; /* Intervals between good samples */
+	u64 iv_sum_us;
+	u32 iv_min_us;
+	u32 iv_max_us;
+	u32 iv_last_us;
+	u32 jitter16_us; /* RFC 3550 interarrival jitter, times 16 */
+	u32 jitter_max_us; /* Largest change between intervals */
+	u64 tx_lat_count; /* Latency of the good transactions */
+	u64 tx_lat_sum_us;
+	u32 tx_lat_min_us;
+	u32 tx_lat_max_us;
+	/* Protects the data above and the health state */
+	spinlock_t lock;
+	/* Serializes USB transactions and the latency window */
+	struct mutex io_mutex;
+	/* Latency window and derived timeout */
+	u32 lat_us[TEMPER_LAT_WINDOW];
+	unsigned int lat_head;
+	unsigned int lat_count;
+	unsigned int lat_p99_us;
+	unsigned int timeout_ms;
+	/* Health */
+	enum temper_health health;
+	unsigned int fail_count;
+	struct delayed_work health_work;
+	/* Recovery */
+	ktime_t fault_start;
+	bool reset_pending;
+	unsigned int resets;
+	unsigned int resets_in_row; /* Since the last good sample */
+	unsigned int recoveries;
+	unsigned int last_downtime_ms;
+	unsigned long long total_downtime_ms;
+	/* Transaction coalescing, protected by io_mutex */
+	unsigned long tx_started;
+	unsigned long tx_done;
+	int tx_last_rc;
+	unsigned long long tx_coalesced;
+	struct temper_client sysfs_client;
+	/* Open files, protected by lock */
+	struct list_head clients;
+	unsigned long long deliveries;
+	unsigned long long suppressed;
+	/* Power management, protected by lock */
+	ktime_t pm_suspended_at;
+	unsigned int pm_suspends;
+	unsigned int pm_resumes;
+	unsigned long long pm_suspended_ms;
+	unsigned int pm_resume_waits; /* Transactions delayed by a resume */
+	unsigned long long pm_resume_lat_us; /* Total delay */
+	unsigned int pm_resume_lat_max_us;
+	bool system_sleep;
+	/* Background sampling */
+	unsigned int sample_interval_ms;
+	struct delayed_work sample_work;
+	u64 sample_seq; /* Protected by lock */
+	/* Last samples, protected by lock */
+	struct temper_sample_ts history[TEMPER_HISTORY_SIZE];
+	unsigned int history_head; /* Next slot */
+	unsigned int history_len;
+	/* io_uring commands waiting for a sample, protected by lock */
+	struct list_head uring_waits;
+	struct work_struct uring_work; /* TEMPER_URING_TRIGGER */
+	bool gone; /* Disconnected, written with lock and io_mutex held */
+	/* Lifetime: the interface binding and every open file hold a reference */
+	struct kref kref;
+	atomic_long_t alloc_objects;
+	atomic_long_t alloc_bytes;
+	u64 probe_ns;
+	u64 first_sample_us; /* Probe to first good sample, protected by lock */
+	/* Grid aligned sampling, protected by lock */
+	struct mutex grid_mutex; /* Serializes the configuration */
+	struct hrtimer grid_real_timer; /* One per clock, see temper_grid_hrtimer() */
+	struct hrtimer grid_tai_timer;
+	struct work_struct grid_work;
+	unsigned int grid_ms;
+	clockid_t grid_clock;
+	u64 grid_next_ns; /* Point the timer is armed for */
+	u64 grid_due_ns; /* Point of the queued work */
+	u64 grid_pending_ns; /* Point of the next transaction */
+	s64 grid_lead_ns; /* Advance of the timer on the grid */
+	u64 grid_samples;
+	u64 grid_missed;
+	u64 grid_err_abs_sum_ns;
+	u64 grid_err_abs_max_ns;
+};
+
+/* An io_uring command waiting for the next sample */
+struct temper_uring_wait {
+	struct list_head node;
+	bool queued; /* In uring_waits, protected by the device lock */
+	struct usb_temper *temper_dev;
+	struct io_uring_cmd *cmd;
+	void __user *addr;
+	bool trigger;
+	int status;
+	struct temper_sample_ts ts;
+};
+
+/* Per command private data, in the io_uring_cmd itself */
+struct temper_uring_pdu {
+	struct temper_uring_wait *wait;
+};
+
+/*
+ * Everything allocated on behalf of a device is accounted, per device and
+ * for the whole driver, so that churn leaks show up in the allocations
+ * files.
+ */
+static void temper_account(struct usb_temper *temper_dev, long bytes,
+			   long objects)
+{
+	atomic_long_add(objects, &temper_dev->alloc_objects);
+	atomic_long_add(bytes, &temper_dev->alloc_bytes);
+	atomic_long_add(objects, &temper_alloc_objects);
+	atomic_long_add(bytes, &temper_alloc_bytes);
+}
+
+static void *temper_alloc(struct usb_temper *temper_dev, size_t size)
+{
+	void *p = kzalloc(size, GFP_KERNEL);
+
+	if (p)
+		temper_account(temper_dev, size, 1);
+
+	return p;
+}
+
+static void temper_free(struct usb_temper *temper_dev, const void *p,
+			size_t size)
+{
+	if (!p)
+		return;
+
+	temper_account(temper_dev, -(long)size, -1);
+	kfree(p);
+}
+
+static struct urb *temper_alloc_urb(struct usb_temper *temper_dev)
+{
+	struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+
+	if (urb)
+		temper_account(temper_dev, sizeof(*urb), 1);
+
+	return urb;
+}
+
+static void temper_free_urb(struct usb_temper *temper_dev, struct urb *urb)
+{
+	if (!urb)
+		return;
+
+	temper_account(temper_dev, -(long)sizeof(*urb), -1);
+	usb_free_urb(urb);
+}
+
+/* A sample as published on netlink */
+struct temper_nl_sample {
+	u32 dev;
+	u64 seq;
+	u64 timestamp_ns;
+	s32 temp_in;
+	s32 temp_out;
+	s32 humidity;
+	u32 status;
+	u64 monotonic_ns;
+	u32 frame;
+	s64 grid_error_ns;
+};
+
+/* Forward declaration */
+static struct usb_driver temper_driver;
+
+/* Table of devices that may be used by this driver */
+static struct usb_device_id temper_id_table[] = {
+	{ USB_DEVICE(0x0c45, 0x7401),
+	  .driver_info = (kernel_ulong_t)&temper_models[TEMPER_MODEL_TEMPER2] },
+	{ USB_DEVICE(0x0c45, 0x7402),
+	  .driver_info = (kernel_ulong_t)&temper_models[TEMPER_MODEL_TEMPERHUM] },
+	{ USB_DEVICE(0x413d, 0x2107),
+	  .driver_info = (kernel_ulong_t)&temper_models[TEMPER_MODEL_413D_2107] },
+	{ /* Sentinel */ },
+};
+MODULE_DEVICE_TABLE(usb, temper_id_table);
+
+/* Generic netlink family, only used to multicast samples */
+enum {
+	TEMPER_NL_MCGRP_SAMPLES,
+};
+
+static const struct genl_multicast_group temper_nl_mcgrps[] = {
+	[TEMPER_NL_MCGRP_SAMPLES] = { .name = TEMPER_NL_MCGRP_SAMPLES_NAME, },
+};
+
+static struct genl_family temper_nl_family = {
+	.name = TEMPER_NL_FAMILY_NAME,
+	.version = TEMPER_NL_VERSION,
+	.maxattr = TEMPER_NL_A_MAX,
+	.module = THIS_MODULE,
+	.mcgrps = temper_nl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(temper_nl_mcgrps),
+};
+
+/* Batch being filled, shared by all the devices */
+static DEFINE_SPINLOCK(temper_nl_lock);
+static struct sk_buff *temper_nl_skb;
+static void *temper_nl_hdr;
+static unsigned int temper_nl_count;
+
+static void temper_nl_flush_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(temper_nl_flush, temper_nl_flush_work);
+
+/* Detach the batch being filled, must be called with temper_nl_lock held */
+static struct sk_buff *temper_nl_take(void)
+{
+	struct sk_buff *skb = temper_nl_skb;
+
+	if (skb)
+		genlmsg_end(skb, temper_nl_hdr);
+	temper_nl_skb = NULL;
+	temper_nl_count = 0;
+
+	return skb;
+}
+
+static void temper_nl_send(struct sk_buff *skb)
+{
+	if (skb)
+		genlmsg_multicast(&temper_nl_family, skb, 0,
+				  TEMPER_NL_MCGRP_SAMPLES, GFP_KERNEL);
+}
+
+static void temper_nl_flush_work(struct work_struct *work)
+{
+	struct sk_buff *skb;
+
+	spin_lock_irq(&temper_nl_lock);
+	skb = temper_nl_take();
+	spin_unlock_irq(&temper_nl_lock);
+
+	temper_nl_send(skb);
+}
+
+static int temper_nl_put_sample(struct sk_buff *skb,
+				const struct temper_nl_sample *s)
+{
+	struct nlattr *nest;
+
+	nest = nla_nest_start(skb, TEMPER_NL_A_SAMPLE);
+	if (!nest)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, TEMPER_NL_S_DEV, s->dev) ||
+	    nla_put_u64_64bit(skb, TEMPER_NL_S_SEQ, s->seq, TEMPER_NL_S_PAD) ||
+	    nla_put_u64_64bit(skb, TEMPER_NL_S_TIMESTAMP, s->timestamp_ns,
+			      TEMPER_NL_S_PAD) ||
+	    nla_put_s32(skb, TEMPER_NL_S_TEMP_IN, s->temp_in) ||
+	    nla_put_u32(skb, TEMPER_NL_S_STATUS, s->status))
+		goto cancel;
+
+	if (nla_put_u64_64bit(skb, TEMPER_NL_S_MONOTONIC, s->monotonic_ns,
+			      TEMPER_NL_S_PAD) ||
+	    (s->frame != TEMPER_NO_FRAME &&
+	     nla_put_u32(skb, TEMPER_NL_S_FRAME, s->frame)))
+		goto cancel;
+
+	if (!(s->status & TEMPER_SAMPLE_NO_OUT) &&
+	    nla_put_s32(skb, TEMPER_NL_S_TEMP_OUT, s->temp_out))
+		goto cancel;
+
+	if (s->status & TEMPER_SAMPLE_HUMIDITY &&
+	    nla_put_s32(skb, TEMPER_NL_S_HUMIDITY, s->humidity))
+		goto cancel;
+
+	if (s->status & TEMPER_SAMPLE_GRID &&
+	    nla_put_s64(skb, TEMPER_NL_S_GRID_ERROR, s->grid_error_ns,
+			TEMPER_NL_S_PAD))
+		goto cancel;
+
+	nla_nest_end(skb, nest);
+
+	return 0;
+
+cancel:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
+
+/*
+ * Publish a sample to the multicast group. Nothing is allocated without
+ * subscribers. Samples are gathered until nl_batch of them are waiting or
+ * the oldest one waited for nl_batch_ms.
+ */
+static void temper_nl_publish(const struct temper_nl_sample *s)
+{
+	struct sk_buff *full = NULL, *skb = NULL;
+	unsigned long flags;
+
+	if (!genl_has_listeners(&temper_nl_family, &init_net,
+				TEMPER_NL_MCGRP_SAMPLES))
+		return;
+
+	spin_lock_irqsave(&temper_nl_lock, flags);
+	for (;;) {
+		if (!temper_nl_skb) {
+			temper_nl_skb = genlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+			if (!temper_nl_skb)
+				break;
+			temper_nl_hdr = genlmsg_put(temper_nl_skb, 0, 0,
+						    &temper_nl_family, 0,
+						    TEMPER_NL_CMD_SAMPLES);
+			if (!temper_nl_hdr) {
+				nlmsg_free(temper_nl_skb);
+				temper_nl_skb = NULL;
+				break;
+			}
+		}
+
+		if (!temper_nl_put_sample(temper_nl_skb, s)) {
+			temper_nl_count++;
+			break;
+		}
+
+		/* Message full, send it and start a new one */
+		if (!temper_nl_count)
+			break;
+		full = temper_nl_take();
+	}
+
+	/* The flush timer follows the batch being filled */
+	if (temper_nl_count >= max(nl_batch, 1U)) {
+		skb = temper_nl_take();
+		cancel_delayed_work(&temper_nl_flush);
+	} else if (temper_nl_count == 1) {
+		mod_delayed_work(system_wq, &temper_nl_flush,
+				 msecs_to_jiffies(nl_batch_ms));
+	}
+	spin_unlock_irqrestore(&temper_nl_lock, flags);
+
+	temper_nl_send(full);
+	temper_nl_send(skb);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Feed the latency window and derive the next timeout from its p99 */
+static void temper_update_timeout(struct usb_temper *temper_dev, u32 lat_us)
+{
+	u32 sorted[TEMPER_LAT_WINDOW];
+	unsigned int n, timeout;
+
+	temper_dev->lat_us[temper_dev->lat_head] = lat_us;
+	temper_dev->lat_head = (temper_dev->lat_head + 1) % TEMPER_LAT_WINDOW;
+	if (temper_dev->lat_count < TEMPER_LAT_WINDOW)
+		temper_dev->lat_count++;
+
+	n = temper_dev->lat_count;
+	if (n < TEMPER_LAT_MIN_SAMPLES)
+		return;
+
+	memcpy(sorted, temper_dev->lat_us, n * sizeof(u32));
+	sort(sorted, n, sizeof(u32), cmp_u32, NULL);
+	temper_dev->lat_p99_us = sorted[DIV_ROUND_UP(n * 99, 100) - 1];
+
+	timeout = DIV_ROUND_UP(temper_dev->lat_p99_us * timeout_mult, 1000);
+	temper_dev->timeout_ms = clamp(timeout, timeout_floor_ms,
+				       (unsigned int)TEMPER_TIMEOUT_MAX_MS);
+}
+
+/* USB frame number, to correlate samples with a bus trace */
+static u32 temper_frame(struct usb_temper *temper_dev)
+{
+	int frame = usb_get_current_frame_number(temper_dev->udev);
+
+	return frame < 0 ? TEMPER_NO_FRAME : frame;
+}
+
+/* Synchronous transport: blocking control and interrupt messages */
+static int temper_sync_xfer(struct usb_temper *temper_dev,
+			    unsigned int timeout_ms)
+{
+	int rc = 0;
+	int l;
+
+	memset(temper_dev->int_in_buffer, 0, TEMPER_INT_BUFFER_SIZE);
+
+	rc = usb_control_msg(temper_dev->udev,
+		usb_sndctrlpipe(temper_dev->udev, 0),
+		TEMPER_CTRL_REQUEST,
+		TEMPER_CTRL_REQUEST_TYPE,
+		TEMPER_CTRL_VALUE,
+		TEMPER_CTRL_INDEX,
+		temper_dev->ctrl_out_buffer,
+		TEMPER_CTRL_BUFFER_SIZE,
+		msecs_to_jiffies(timeout_ms));
+
+	if (rc < 0) {
+	        printk(KERN_ERR "temper: control message failed (%d)", rc);
+		return rc;
+        }
+
+	rc = usb_interrupt_msg (temper_dev->udev,
+		usb_rcvintpipe(temper_dev->udev, TEMPER_INT_IN_EPNUM),
+		temper_dev->int_in_buffer,
+		TEMPER_INT_BUFFER_SIZE,
+		&l,
+		msecs_to_jiffies(timeout_ms));
+	/* No hook in the completion, stamped once woken up */
+	temper_dev->report_ns = ktime_get_ns();
+	temper_dev->report_frame = temper_frame(temper_dev);
+	if (rc < 0) {
+	        printk(KERN_ERR "temper: interrupt message failed (%d)", rc);
+		return rc;
+        }
+
+	memcpy(temper_dev->report, temper_dev->int_in_buffer, l);
+
+	return l;
+}
+
+/* URB based transports */
+static void temper_ctrl_out_callback(struct urb *urb)
+{
+	struct usb_temper *temper_dev = urb->context;
+
+	/* The answer comes on the interrupt EP, only errors matter here */
+	if (!urb->status)
+		return;
+
+	temper_dev->ctrl_status = urb->status;
+	complete(&temper_dev->int_done);
+	wake_up(&temper_dev->stream_wq);
+}
+
+static int temper_urbs_alloc(struct usb_temper *temper_dev,
+			     usb_complete_t int_in_callback)
+{
+	/* Set up the interrupt in URB */
+	temper_dev->int_in_urb = temper_alloc_urb(temper_dev);
+	if (!temper_dev->int_in_urb) {
+		printk(KERN_ERR "temper: could not allocate int_in_urb");
+		return -ENOMEM;
+	}
+
+	usb_fill_int_urb(temper_dev->int_in_urb,
+			 temper_dev->udev,
+			 usb_rcvintpipe(temper_dev->udev, TEMPER_INT_IN_EPNUM),
+			 temper_dev->int_in_buffer,
+			 TEMPER_INT_BUFFER_SIZE,
+			 int_in_callback,
+			 temper_dev,
+			 temper_dev->int_in_endpoint->bInterval);
+
+	/* Set up the control out URB */
+	temper_dev->ctrl_out_cr = temper_alloc(temper_dev,
+					       sizeof(struct usb_ctrlrequest));
+	if (!temper_dev->ctrl_out_cr) {
+		printk(KERN_ERR "temper: could not allocate usb_ctrlrequest");
+		goto free_int_urb;
+	}
+
+	temper_dev->ctrl_out_cr->bRequestType = TEMPER_CTRL_REQUEST_TYPE;
+	temper_dev->ctrl_out_cr->bRequest = TEMPER_CTRL_REQUEST;
+	temper_dev->ctrl_out_cr->wValue = cpu_to_le16(TEMPER_CTRL_VALUE);
+	temper_dev->ctrl_out_cr->wIndex = cpu_to_le16(TEMPER_CTRL_INDEX);
+	temper_dev->ctrl_out_cr->wLength = cpu_to_le16(TEMPER_CTRL_BUFFER_SIZE);
+
+	temper_dev->ctrl_out_urb = temper_alloc_urb(temper_dev);
+	if (!temper_dev->ctrl_out_urb) {
+		printk(KERN_ERR "temper: could not allocate ctrl_out_urb");
+		goto free_out_cr;
+	}
+
+	usb_fill_control_urb(temper_dev->ctrl_out_urb,
+			     temper_dev->udev,
+			     usb_sndctrlpipe(temper_dev->udev, 0),
+			     (unsigned char *)temper_dev->ctrl_out_cr,
+			     temper_dev->ctrl_out_buffer,
+			     TEMPER_CTRL_BUFFER_SIZE,
+			     temper_ctrl_out_callback,
+			     temper_dev);
+
+	return 0;
+
+free_out_cr:
+	temper_free(temper_dev, temper_dev->ctrl_out_cr,
+		    sizeof(struct usb_ctrlrequest));
+	temper_dev->ctrl_out_cr = NULL;
+free_int_urb:
+	temper_free_urb(temper_dev, temper_dev->int_in_urb);
+	temper_dev->int_in_urb = NULL;
+	return -ENOMEM;
+}
+
+static void temper_urbs_free(struct usb_temper *temper_dev)
+{
+	temper_free_urb(temper_dev, temper_dev->ctrl_out_urb);
+	temper_dev->ctrl_out_urb = NULL;
+	temper_free(temper_dev, temper_dev->ctrl_out_cr,
+		    sizeof(struct usb_ctrlrequest));
+	temper_dev->ctrl_out_cr = NULL;
+	temper_free_urb(temper_dev, temper_dev->int_in_urb);
+	temper_dev->int_in_urb = NULL;
+}
+
+static void temper_urbs_kill(struct usb_temper *temper_dev)
+{
+	usb_kill_urb(temper_dev->ctrl_out_urb);
+	usb_kill_urb(temper_dev->int_in_urb);
+}
+
+/* Asynchronous URB engine: both URBs submitted per sample */
+static void temper_urb_int_in_callback(struct urb *urb)
+{
+	struct usb_temper *temper_dev = urb->context;
+	u64 start = ktime_get_ns();
+
+	temper_dev->int_status = urb->status;
+	if (!urb->status) {
+		temper_dev->int_length = min_t(int, urb->actual_length,
+					       TEMPER_INT_BUFFER_SIZE);
+		memcpy(temper_dev->report, temper_dev->int_in_buffer,
+		       temper_dev->int_length);
+		temper_dev->report_ns = start;
+		temper_dev->report_frame = temper_frame(temper_dev);
+	}
+	complete(&temper_dev->int_done);
+
+	atomic64_add(ktime_get_ns() - start, &temper_dev->cb_ns);
+}
+
+static int temper_urb_init(struct usb_temper *temper_dev)
+{
+	return temper_urbs_alloc(temper_dev, temper_urb_int_in_callback);
+}
+
+static int temper_urb_xfer(struct usb_temper *temper_dev,
+			   unsigned int timeout_ms)
+{
+	int rc;
+
+	reinit_completion(&temper_dev->int_done);
+	temper_dev->ctrl_status = 0;
+	temper_dev->int_status = -EINPROGRESS;
+	temper_dev->int_length = 0;
+
+	rc = usb_submit_urb(temper_dev->int_in_urb, GFP_KERNEL);
+	if (rc) {
+		printk(KERN_ERR "temper: submit int in urb failed (%d)", rc);
+		return rc;
+	}
+
+	rc = usb_submit_urb(temper_dev->ctrl_out_urb, GFP_KERNEL);
+	if (rc < 0) {
+		printk(KERN_ERR "temper: submit ctrl failed (%d)\n", rc);
+		usb_kill_urb(temper_dev->int_in_urb);
+		return rc;
+	}
+
+	if (!wait_for_completion_timeout(&temper_dev->int_done,
+					 msecs_to_jiffies(timeout_ms)))
+		rc = -ETIMEDOUT;
+
+	/* Both URBs must be idle before being submitted again */
+	temper_urbs_kill(temper_dev);
+
+	if (rc)
+		return rc;
+	if (temper_dev->ctrl_status)
+		return temper_dev->ctrl_status;
+	if (temper_dev->int_status)
+		return temper_dev->int_status;
+
+	return temper_dev->int_length;
+}
+
+/*
+ * Streaming pipeline: the interrupt URB stays posted and is resubmitted
+ * from its completion handler, only the control URB is sent per sample.
+ */
+static void temper_stream_int_in_callback(struct urb *urb)
+{
+	struct usb_temper *temper_dev = urb->context;
+	u64 start = ktime_get_ns();
+	unsigned long flags;
+	int rc = urb->status;
+
+	spin_lock_irqsave(&temper_dev->lock, flags);
+	temper_dev->int_status = urb->status;
+	/* The answer to a request which gave up comes first, it is not ours */
+	if (!urb->status && temper_dev->stream_answer_due) {
+		temper_dev->stream_answer_due = false;
+	} else if (!urb->status) {
+		temper_dev->int_length = min_t(int, urb->actual_length,
+					       TEMPER_INT_BUFFER_SIZE);
+		memcpy(temper_dev->stream_report, temper_dev->int_in_buffer,
+		       temper_dev->int_length);
+		temper_dev->stream_report_ns = start;
+		temper_dev->stream_report_frame = temper_frame(temper_dev);
+		temper_dev->stream_seq++;
+	}
+	spin_unlock_irqrestore(&temper_dev->lock, flags);
+
+	/* Errors stop the stream, the next transaction restarts it */
+	if (!rc)
+		rc = usb_submit_urb(urb, GFP_ATOMIC);
+	if (rc) {
+		if (rc != -ENOENT && rc != -ECONNRESET && rc != -ESHUTDOWN)
+			printk(KERN_ERR "temper: stream stopped (%d)\n", rc);
+		WRITE_ONCE(temper_dev->stream_running, false);
+	}
+	wake_up(&temper_dev->stream_wq);
+
+	atomic64_add(ktime_get_ns() - start, &temper_dev->cb_ns);
+}
+
+static int temper_stream_init(struct usb_temper *temper_dev)
+{
+	return temper_urbs_alloc(temper_dev, temper_stream_int_in_callback);
+}
+
+static int temper_stream_start(struct usb_temper *temper_dev)
+{
+	int rc;
+
+	if (READ_ONCE(temper_dev->stream_running))
+		return 0;
+
+	WRITE_ONCE(temper_dev->stream_running, true);
+	rc = usb_submit_urb(temper_dev->int_in_urb, GFP_NOIO);
+	if (rc) {
+		printk(KERN_ERR "temper: submit int in urb failed (%d)", rc);
+		WRITE_ONCE(temper_dev->stream_running, false);
+	}
+
+	return rc;
+}
+
+static void temper_stream_stop(struct usb_temper *temper_dev)
+{
+	temper_urbs_kill(temper_dev);
+	WRITE_ONCE(temper_dev->stream_running, false);
+}
+
+static int temper_stream_xfer(struct usb_temper *temper_dev,
+			      unsigned int timeout_ms)
+{
+	unsigned long seq;
+	int rc;
+
+	rc = temper_stream_start(temper_dev);
+	if (rc)
+		return rc;
+
+	/* Drain the late answer of a failed request, not to take it for ours */
+	if (READ_ONCE(temper_dev->stream_answer_due))
+		wait_event_timeout(temper_dev->stream_wq,
+				   !READ_ONCE(temper_dev->stream_answer_due) ||
+				   !READ_ONCE(temper_dev->stream_running),
+				   msecs_to_jiffies(TEMPER_DRAIN_MS));
+
+	spin_lock_irq(&temper_dev->lock);
+	temper_dev->stream_answer_due = false;
+	seq = temper_dev->stream_seq;
+	spin_unlock_irq(&temper_dev->lock);
+	temper_dev->ctrl_status = 0;
+
+	rc = usb_submit_urb(temper_dev->ctrl_out_urb, GFP_KERNEL);
+	if (rc < 0) {
+		printk(KERN_ERR "temper: submit ctrl failed (%d)\n", rc);
+		return rc;
+	}
+
+	if (!wait_event_timeout(temper_dev->stream_wq,
+				READ_ONCE(temper_dev->stream_seq) != seq ||
+				!READ_ONCE(temper_dev->stream_running) ||
+				READ_ONCE(temper_dev->ctrl_status),
+				msecs_to_jiffies(timeout_ms)))
+		rc = -ETIMEDOUT;
+
+	usb_kill_urb(temper_dev->ctrl_out_urb);
+
+	spin_lock_irq(&temper_dev->lock);
+	if (rc) {
+		/* Sent, but unanswered: the answer may still come */
+		if (temper_dev->stream_seq == seq && !temper_dev->ctrl_status)
+			temper_dev->stream_answer_due = true;
+	} else if (temper_dev->stream_seq != seq) {
+		memcpy(temper_dev->report, temper_dev->stream_report,
+		       temper_dev->int_length);
+		temper_dev->report_ns = temper_dev->stream_report_ns;
+		temper_dev->report_frame = temper_dev->stream_report_frame;
+		rc = temper_dev->int_length;
+	} else if (temper_dev->ctrl_status) {
+		rc = temper_dev->ctrl_status;
+	} else {
+		rc = temper_dev->int_status ? temper_dev->int_status : -EIO;
+	}
+	spin_unlock_irq(&temper_dev->lock);
+
+	return rc;
+}
+
+static const struct temper_transport temper_transports[TEMPER_NR_TRANSPORTS] = {
+	{
+		.name = "sync",
+		.xfer = temper_sync_xfer,
+	},
+	{
+		.name = "urb",
+		.init = temper_urb_init,
+		.release = temper_urbs_free,
+		.stop = temper_urbs_kill,
+		.xfer = temper_urb_xfer,
+	},
+	{
+		.name = "stream",
+		.init = temper_stream_init,
+		.release = temper_urbs_free,
+		.start = temper_stream_start,
+		.stop = temper_stream_stop,
+		.xfer = temper_stream_xfer,
+	},
 };
 
-/* Table of devices that may be used by this driver */
-static struct usb_device_id temper_id_table[] = {
-	{ USB_DEVICE(TEMPER_VID, TEMPER_PID) },
-	{ /* Sentinel */ },
-};
-MODULE_DEVICE_TABLE(usb, temper_id_table);
+static const struct temper_transport *temper_find_transport(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(temper_transports); i++)
+		if (sysfs_streq(name, temper_transports[i].name))
+			return &temper_transports[i];
+
+	return NULL;
+}
+
+static int temper_transport_start(struct usb_temper *temper_dev)
+{
+	const struct temper_transport *t = temper_dev->transport;
+
+	return t->start ? t->start(temper_dev) : 0;
+}
+
+static void temper_transport_stop(struct usb_temper *temper_dev)
+{
+	const struct temper_transport *t = temper_dev->transport;
+
+	if (t->stop)
+		t->stop(temper_dev);
+}
+
+/*
+ * Switch to transport @t, falling back to the synchronous one (which
+ * cannot fail) on error so that a transport is always usable.
+ */
+static int temper_transport_setup(struct usb_temper *temper_dev,
+				  const struct temper_transport *t)
+{
+	int rc;
+
+	temper_dev->transport = t;
+	rc = t->init ? t->init(temper_dev) : 0;
+	if (!rc) {
+		rc = temper_transport_start(temper_dev);
+		if (!rc)
+			return 0;
+		if (t->release)
+			t->release(temper_dev);
+	}
+
+	printk(KERN_ERR "temper: cannot use transport %s (%d), falling back to sync\n",
+	       t->name, rc);
+	temper_dev->transport = &temper_transports[0];
+
+	return rc;
+}
+
+static void temper_transport_teardown(struct usb_temper *temper_dev)
+{
+	const struct temper_transport *t = temper_dev->transport;
+
+	temper_transport_stop(temper_dev);
+	if (t->release)
+		t->release(temper_dev);
+}
+
+/* Wake the device up if needed, accounting for the time it took */
+static int temper_autopm_get(struct usb_temper *temper_dev)
+{
+	unsigned int resumes = READ_ONCE(temper_dev->pm_resumes);
+	ktime_t start = ktime_get();
+	unsigned int lat_us;
+	int rc;
+
+	rc = usb_autopm_get_interface(temper_dev->interface);
+	if (rc || READ_ONCE(temper_dev->pm_resumes) == resumes)
+		return rc;
+
+	lat_us = ktime_us_delta(ktime_get(), start);
+	spin_lock_irq(&temper_dev->lock);
+	temper_dev->pm_resume_waits++;
+	temper_dev->pm_resume_lat_us += lat_us;
+	temper_dev->pm_resume_lat_max_us = max(temper_dev->pm_resume_lat_max_us,
+					       lat_us);
+	spin_unlock_irq(&temper_dev->lock);
+
+	return 0;
+}
+
+/*
+ * usb_queue_reset_device() silently drops the reset when it cannot lock
+ * the device, which it never can while the device is suspended. Keep it
+ * awake until post_reset(), and arm the health probe as a fallback in
+ * case post_reset() never comes.
+ */
+static void temper_reset_queue(struct usb_temper *temper_dev)
+{
+	unsigned int delay_ms = TEMPER_RESET_WAIT_MS;
+
+	printk(KERN_WARNING "temper: device looks wedged, resetting it\n");
+	if (!usb_autopm_get_interface(temper_dev->interface)) {
+		usb_queue_reset_device(temper_dev->interface);
+	} else {
+		spin_lock_irq(&temper_dev->lock);
+		temper_dev->reset_pending = false;
+		spin_unlock_irq(&temper_dev->lock);
+		delay_ms = probe_interval_ms;
+	}
+
+	mod_delayed_work(system_wq, &temper_dev->health_work,
+			 msecs_to_jiffies(delay_ms));
+}
+
+/* Forget a reset which was dropped, true if there was one */
+static bool temper_reset_forget(struct usb_temper *temper_dev)
+{
+	bool pending;
+
+	spin_lock_irq(&temper_dev->lock);
+	pending = temper_dev->reset_pending;
+	temper_dev->reset_pending = false;
+	spin_unlock_irq(&temper_dev->lock);
+
+	if (pending)
+		usb_autopm_put_interface_async(temper_dev->interface);
+
+	return pending;
+}
+
+/*
+ * Account a good sample completed at report_ns, for a transaction started
+ * at start_ns. Intervals are only meaningful when sampling periodically.
+ * Must be called with lock held.
+ */
+static void temper_timing_update(struct usb_temper *temper_dev, u64 start_ns)
+{
+	u64 now_ns = temper_dev->report_ns;
+	u32 lat_us, iv_us, d_us;
+
+	lat_us = div_u64(now_ns - start_ns, NSEC_PER_USEC);
+	if (!temper_dev->tx_lat_count++ || lat_us < temper_dev->tx_lat_min_us)
+		temper_dev->tx_lat_min_us = lat_us;
+	temper_dev->tx_lat_max_us = max(temper_dev->tx_lat_max_us, lat_us);
+	temper_dev->tx_lat_sum_us += lat_us;
+
+	if (temper_dev->sample_ns) {
+		iv_us = div_u64(now_ns - temper_dev->sample_ns, NSEC_PER_USEC);
+		if (!temper_dev->iv_count++ || iv_us < temper_dev->iv_min_us)
+			temper_dev->iv_min_us = iv_us;
+		temper_dev->iv_max_us = max(temper_dev->iv_max_us, iv_us);
+		temper_dev->iv_sum_us += iv_us;
+
+		if (temper_dev->iv_count > 1) {
+			d_us = abs((s32)(iv_us - temper_dev->iv_last_us));
+			temper_dev->jitter16_us += d_us -
+				((temper_dev->jitter16_us + 8) >> 4);
+			temper_dev->jitter_max_us = max(temper_dev->jitter_max_us,
+							d_us);
+		}
+		temper_dev->iv_last_us = iv_us;
+	}
+
+	temper_dev->sample_ns = now_ns;
+	temper_dev->sample_real_ns =
+		ktime_to_ns(ktime_mono_to_real(ns_to_ktime(now_ns)));
+	temper_dev->sample_frame = temper_dev->report_frame;
+}
+
+/* A CLOCK_MONOTONIC time on the clock of the grid */
+static u64 temper_grid_time(struct usb_temper *temper_dev, u64 mono_ns)
+{
+	ktime_t t = ns_to_ktime(mono_ns);
+
+	if (temper_dev->grid_clock == CLOCK_TAI)
+		return ktime_to_ns(ktime_mono_to_any(t, TK_OFFS_TAI));
+
+	return ktime_to_ns(ktime_mono_to_real(t));
+}
+
+/* First grid point at or after @t */
+static u64 temper_grid_point(u64 t, u64 period_ns)
+{
+	return div64_u64(t + period_ns - 1, period_ns) * period_ns;
+}
+
+/*
+ * Account the alignment of a sample read for the grid point @grid_ns, and
+ * move the timer lead so that the next report lands on the grid. The lead
+ * starts from the mean transaction latency and follows a quarter of the
+ * error, which absorbs the workqueue and resume latencies as well.
+ * Must be called with lock held.
+ */
+static void temper_grid_update(struct usb_temper *temper_dev, u64 grid_ns)
+{
+	u64 period_ns = (u64)temper_dev->grid_ms * NSEC_PER_MSEC;
+	s64 err;
+
+	temper_dev->sample_on_grid = grid_ns && period_ns;
+	if (!temper_dev->sample_on_grid)
+		return;
+
+	err = temper_grid_time(temper_dev, temper_dev->report_ns) - grid_ns;
+	temper_dev->sample_grid_err_ns = err;
+	temper_dev->grid_samples++;
+	temper_dev->grid_err_abs_sum_ns += abs(err);
+	temper_dev->grid_err_abs_max_ns = max_t(u64, temper_dev->grid_err_abs_max_ns,
+						abs(err));
+
+	temper_dev->grid_lead_ns = clamp_t(s64, temper_dev->grid_lead_ns +
+					   div_s64(err, 4), 0, period_ns / 2);
+}
+
+/* Sample flags describing what the model measures */
+static u32 temper_model_flags(const struct temper_model *model)
+{
+	u32 flags = 0;
+
+	if (model->channels < 2)
+		flags |= TEMPER_SAMPLE_NO_OUT;
+	if (model->humidity)
+		flags |= TEMPER_SAMPLE_HUMIDITY;
+
+	return flags;
+}
+
+/* Must be called with lock held */
+static void temper_fill_sample(struct usb_temper *temper_dev,
+			       struct temper_sample_ts *ts)
+{
+	struct temper_sample *sample = &ts->sample;
+
+	memset(ts, 0, sizeof(*ts));
+	sample->temp_in = temper_dev->temp_in;
+	sample->temp_out = temper_dev->temp_out;
+	sample->flags = temper_model_flags(temper_dev->model);
+	ts->humidity = temper_dev->humidity;
+	ts->seq = temper_dev->sample_seq;
+	ts->timestamp_ns = temper_dev->sample_ns;
+	ts->realtime_ns = temper_dev->sample_real_ns;
+	ts->frame = temper_dev->has_sample ? temper_dev->sample_frame :
+		    TEMPER_NO_FRAME;
+	if (temper_dev->has_sample) {
+		sample->flags |= TEMPER_SAMPLE_VALID;
+		sample->age_ms = ktime_ms_delta(ktime_get(), temper_dev->last_good);
+	}
+	if (temper_dev->health != TEMPER_HEALTHY)
+		sample->flags |= TEMPER_SAMPLE_STALE;
+	if (temper_dev->sample_on_grid) {
+		sample->flags |= TEMPER_SAMPLE_GRID;
+		ts->grid_error_ns = temper_dev->sample_grid_err_ns;
+	}
+}
+
+/* Whether a sample moved enough to be delivered, lock held */
+static bool temper_client_wants(struct temper_client *client,
+				const struct temper_sample_ts *ts)
+{
+	const struct temper_deadband *db = &client->deadband;
+	const struct temper_sample_ts *last = &client->last;
+
+	if (!(db->flags & TEMPER_DEADBAND_ENABLE) || !client->delivered)
+		return true;
+
+	if (db->heartbeat_ms && ts->timestamp_ns - last->timestamp_ns >=
+	    (u64)db->heartbeat_ms * NSEC_PER_MSEC)
+		return true;
+
+	if (abs(ts->sample.temp_in - last->sample.temp_in) > db->deadband_mc)
+		return true;
+
+	if (!(ts->sample.flags & TEMPER_SAMPLE_NO_OUT) &&
+	    abs(ts->sample.temp_out - last->sample.temp_out) > db->deadband_mc)
+		return true;
+
+	if (ts->sample.flags & TEMPER_SAMPLE_HUMIDITY &&
+	    abs(ts->humidity - last->humidity) > db->deadband_mrh)
+		return true;
+
+	return false;
+}
+
+/*
+ * Hand a new sample to the open files, only waking up those for which it
+ * is worth it. Must be called with lock held.
+ */
+static void temper_clients_notify(struct usb_temper *temper_dev,
+				  const struct temper_sample_ts *ts)
+{
+	struct temper_client *client;
+
+	list_for_each_entry(client, &temper_dev->clients, node) {
+		if (!temper_client_wants(client, ts)) {
+			temper_dev->suppressed++;
+			continue;
+		}
+
+		client->next = *ts;
+		client->pending = true;
+		client->last = *ts;
+		client->delivered = true;
+		temper_dev->deliveries++;
+		wake_up_interruptible(&client->wq);
+	}
+}
+
+/* Must be called with lock held */
+static void temper_history_add(struct usb_temper *temper_dev,
+			       const struct temper_sample_ts *ts)
+{
+	temper_dev->history[temper_dev->history_head] = *ts;
+	temper_dev->history_head = (temper_dev->history_head + 1) %
+				   TEMPER_HISTORY_SIZE;
+	if (temper_dev->history_len < TEMPER_HISTORY_SIZE)
+		temper_dev->history_len++;
+}
+
+static struct temper_uring_pdu *temper_uring_pdu(struct io_uring_cmd *cmd)
+{
+	BUILD_BUG_ON(sizeof(struct temper_uring_pdu) > sizeof(cmd->pdu));
+
+	return (struct temper_uring_pdu *)cmd->pdu;
+}
+
+/* Runs in the submitter context, where the buffer can be reached */
+static void temper_uring_task_done(struct io_uring_cmd *cmd,
+				   unsigned int issue_flags)
+{
+	struct temper_uring_wait *wait = temper_uring_pdu(cmd)->wait;
+	int rc = wait->status;
+
+	if (!rc && copy_to_user(wait->addr, &wait->ts, sizeof(wait->ts)))
+		rc = -EFAULT;
+	/* The file, hence the device, outlives the command */
+	temper_free(wait->temper_dev, wait, sizeof(*wait));
+
+	io_uring_cmd_done(cmd, rc, 0, issue_flags);
+}
+
+/* Complete the commands moved out of uring_waits */
+static void temper_uring_complete(struct list_head *done)
+{
+	struct temper_uring_wait *wait, *tmp;
+
+	list_for_each_entry_safe(wait, tmp, done, node) {
+		list_del_init(&wait->node);
+		io_uring_cmd_complete_in_task(wait->cmd, temper_uring_task_done);
+	}
+}
+
+/* Hand a new sample to the waiting commands, lock held */
+static void temper_uring_notify(struct usb_temper *temper_dev,
+				const struct temper_sample_ts *ts,
+				struct list_head *done)
+{
+	struct temper_uring_wait *wait;
+
+	list_for_each_entry(wait, &temper_dev->uring_waits, node) {
+		wait->ts = *ts;
+		wait->queued = false;
+	}
+	list_splice_init(&temper_dev->uring_waits, done);
+}
+
+/* Fail the waiting commands, only the triggering ones if @trigger */
+static void temper_uring_fail(struct usb_temper *temper_dev, int status,
+			      bool trigger)
+{
+	struct temper_uring_wait *wait, *tmp;
+	LIST_HEAD(done);
+
+	spin_lock_irq(&temper_dev->lock);
+	list_for_each_entry_safe(wait, tmp, &temper_dev->uring_waits, node) {
+		if (trigger && !wait->trigger)
+			continue;
+		wait->status = status;
+		wait->queued = false;
+		list_move_tail(&wait->node, &done);
+	}
+	spin_unlock_irq(&temper_dev->lock);
+
+	temper_uring_complete(&done);
+}
+
+/* Must be called with io_mutex held */
+static int temper_transaction(struct usb_temper *temper_dev,
+			      unsigned int timeout_ms)
+{
+	ktime_t start, end;
+	bool enter_fast_fail = false, queue_reset = false, give_up = false;
+	struct temper_nl_sample nl_sample;
+	struct temper_reading reading = { };
+	const struct temper_model *model = temper_dev->model;
+	struct temper_sample_ts ts;
+	LIST_HEAD(uring_done);
+	u64 grid_ns;
+	int rc;
+
+	if (temper_dev->gone)
+		return -ENODEV;
+
+	/* Only a transaction started after the grid work is on the grid */
+	spin_lock_irq(&temper_dev->lock);
+	grid_ns = temper_dev->grid_pending_ns;
+	temper_dev->grid_pending_ns = 0;
+	spin_unlock_irq(&temper_dev->lock);
+
+	temper_dev->tx_started++;
+	/* The resume time must not inflate the adaptive timeout */
+	rc = temper_autopm_get(temper_dev);
+	start = ktime_get();
+	if (!rc) {
+		rc = temper_dev->transport->xfer(temper_dev, timeout_ms);
+		usb_autopm_put_interface(temper_dev->interface);
+	}
+	end = ktime_get();
+
+	if (rc >= 0 && rc < TEMPER_INT_BUFFER_SIZE) {
+		printk(KERN_ERR "temper: short report (%dB)\n", rc);
+		rc = -EPROTO;
+	}
+
+	if (rc >= 0) {
+		model->decode(temper_dev->report, &reading);
+		if (!temper_reading_plausible(model, &reading)) {
+			printk(KERN_ERR "temper: implausible report %d/%d m°C\n",
+			       reading.temp[0], reading.temp[1]);
+			rc = -EPROTO;
+		}
+	}
+
+	spin_lock_irq(&temper_dev->lock);
+	if (rc >= 0) {
+		temper_dev->temp_in = reading.temp[0];
+		temper_dev->temp_out = reading.temp[1];
+		temper_dev->humidity = reading.humidity;
+		temper_dev->last_good = ns_to_ktime(temper_dev->report_ns);
+		if (!temper_dev->has_sample)
+			temper_dev->first_sample_us =
+				div_u64(temper_dev->report_ns -
+					temper_dev->probe_ns, NSEC_PER_USEC);
+		temper_dev->has_sample = true;
+		temper_dev->fail_count = 0;
+		temper_dev->resets_in_row = 0;
+		nl_sample.seq = ++temper_dev->sample_seq;
+		temper_timing_update(temper_dev, ktime_to_ns(start));
+		temper_grid_update(temper_dev, grid_ns);
+		temper_fill_sample(temper_dev, &ts);
+		temper_history_add(temper_dev, &ts);
+		temper_clients_notify(temper_dev, &ts);
+		temper_uring_notify(temper_dev, &ts, &uring_done);
+		rc = 0;
+	} else {
+		if (!temper_dev->fail_count++ &&
+		    temper_dev->health == TEMPER_HEALTHY)
+			temper_dev->fault_start = start;
+		/*
+		 * A stick still answering garbage after a few resets will not
+		 * be fixed by more of them, it is left to the health probe.
+		 */
+		if (reset_threshold && !temper_dev->reset_pending &&
+		    temper_dev->fail_count >= reset_threshold &&
+		    (!reset_limit || temper_dev->resets_in_row < reset_limit)) {
+			temper_dev->reset_pending = true;
+			temper_dev->resets++;
+			if (++temper_dev->resets_in_row == reset_limit)
+				give_up = true;
+			queue_reset = true;
+		}
+		if (temper_dev->health == TEMPER_HEALTHY &&
+		    (temper_dev->fail_count >= fail_threshold || queue_reset)) {
+			temper_dev->health = TEMPER_FAST_FAIL;
+			enter_fast_fail = true;
+		}
+	}
+	spin_unlock_irq(&temper_dev->lock);
+
+	temper_uring_complete(&uring_done);
+
+	temper_dev->tx_last_rc = rc;
+	temper_dev->tx_done++;
+
+	if (!rc) {
+		temper_update_timeout(temper_dev, ktime_us_delta(end, start));
+
+		nl_sample.dev = temper_dev->interface->minor;
+		nl_sample.monotonic_ns = temper_dev->report_ns;
+		nl_sample.timestamp_ns = temper_dev->sample_real_ns;
+		nl_sample.frame = temper_dev->report_frame;
+		nl_sample.temp_in = reading.temp[0];
+		nl_sample.temp_out = reading.temp[1];
+		nl_sample.humidity = reading.humidity;
+		nl_sample.status = TEMPER_SAMPLE_VALID |
+				   temper_model_flags(model);
+		if (ts.sample.flags & TEMPER_SAMPLE_GRID) {
+			nl_sample.status |= TEMPER_SAMPLE_GRID;
+			nl_sample.grid_error_ns = ts.grid_error_ns;
+		}
+		temper_nl_publish(&nl_sample);
+	}
+
+	if (enter_fast_fail)
+		printk(KERN_WARNING "temper: %u consecutive failures, entering fast-fail\n",
+		       temper_dev->fail_count);
+
+	if (give_up)
+		printk(KERN_WARNING "temper: last reset before a good sample, not resetting again\n");
+	if (queue_reset) {
+		temper_reset_queue(temper_dev);
+	} else if (enter_fast_fail) {
+		schedule_delayed_work(&temper_dev->health_work,
+				      msecs_to_jiffies(probe_interval_ms));
+	}
+
+	return rc;
+}
+
+/*
+ * Read a fresh sample. A failing device answers -EAGAIN right away, the
+ * last good sample being still returned in @sample (if not NULL).
+ *
+ * Readers queued on io_mutex share the transaction started after their
+ * arrival rather than issuing one each: whatever the number of waiters,
+ * each of them waits for at most two transactions.
+ */
+static int get_temp_value(struct usb_temper *temper_dev,
+			  struct temper_sample_ts *sample)
+{
+	unsigned long ticket;
+	int rc = -EAGAIN;
+
+	/* Fast path: do not even wait for the health probe to finish */
+	if (READ_ONCE(temper_dev->health) == TEMPER_HEALTHY) {
+		ticket = READ_ONCE(temper_dev->tx_started);
+
+		if (mutex_lock_interruptible(&temper_dev->io_mutex))
+			return -ERESTARTSYS;
+
+		if (temper_dev->tx_done > ticket) {
+			rc = temper_dev->tx_last_rc;
+			temper_dev->tx_coalesced++;
+		} else if (READ_ONCE(temper_dev->health) == TEMPER_HEALTHY) {
+			rc = temper_transaction(temper_dev,
+						temper_dev->timeout_ms);
+		}
+
+		mutex_unlock(&temper_dev->io_mutex);
+	}
+
+	if (sample) {
+		spin_lock_irq(&temper_dev->lock);
+		temper_fill_sample(temper_dev, sample);
+		spin_unlock_irq(&temper_dev->lock);
+	}
+
+	return rc;
+}
+
+static void temper_client_init(struct temper_client *client,
+			       struct usb_temper *temper_dev)
+{
+	memset(client, 0, sizeof(*client));
+	client->temper_dev = temper_dev;
+	client->tokens = client_burst * 1000;
+	client->last_refill = ktime_get();
+	INIT_LIST_HEAD(&client->node);
+	init_waitqueue_head(&client->wq);
+}
+
+/*
+ * Refill the bucket and try to take one token. Returns 0 on success or the
+ * time to wait for the next token, in µs. Must be called with lock held.
+ */
+static unsigned int temper_client_take_token(struct temper_client *client)
+{
+	unsigned int cap = client_burst * 1000, rate = client_rate;
+	ktime_t now = ktime_get();
+	u64 refill;
+
+	if (!rate)
+		return 0;
+
+	refill = div_u64(ktime_us_delta(now, client->last_refill) * rate, 1000);
+	client->tokens = min_t(u64, cap, client->tokens + refill);
+	client->last_refill = now;
+
+	if (client->tokens >= 1000) {
+		client->tokens -= 1000;
+		return 0;
+	}
+
+	return DIV_ROUND_UP((1000 - client->tokens) * 1000, rate);
+}
+
+/*
+ * Read a sample on behalf of a client. Clients over budget are served
+ * from the cache, or throttled until a token is available if there is no
+ * sample to serve yet.
+ */
+static int temper_client_get(struct temper_client *client,
+			     struct temper_sample_ts *sample, bool nonblock)
+{
+	struct usb_temper *temper_dev = client->temper_dev;
+	unsigned int wait_us;
+	bool throttled = false;
+
+	spin_lock_irq(&temper_dev->lock);
+	client->stats.requests++;
+	spin_unlock_irq(&temper_dev->lock);
+
+	for (;;) {
+		spin_lock_irq(&temper_dev->lock);
+		wait_us = temper_client_take_token(client);
+		if (wait_us && temper_dev->has_sample) {
+			client->stats.cached++;
+			temper_fill_sample(temper_dev, sample);
+			sample->sample.flags |= TEMPER_SAMPLE_CACHED;
+			spin_unlock_irq(&temper_dev->lock);
+			return 0;
+		}
+		if (!wait_us)
+			client->stats.transactions++;
+		else if (!throttled)
+			client->stats.throttled++;
+		spin_unlock_irq(&temper_dev->lock);
+		throttled = true;
+
+		if (!wait_us)
+			return get_temp_value(temper_dev, sample);
+
+		if (nonblock)
+			return -EAGAIN;
+
+		if (msleep_interruptible(DIV_ROUND_UP(wait_us, 1000)))
+			return -ERESTARTSYS;
+	}
+}
+
+/* Background sampler, feeds the netlink subscribers */
+static void temper_sample_work(struct work_struct *work)
+{
+	struct usb_temper *temper_dev = container_of(to_delayed_work(work),
+						     struct usb_temper,
+						     sample_work);
+	unsigned int interval_ms = READ_ONCE(temper_dev->sample_interval_ms);
+
+	if (!interval_ms)
+		return;
+
+	get_temp_value(temper_dev, NULL);
+
+	schedule_delayed_work(&temper_dev->sample_work,
+			      msecs_to_jiffies(interval_ms));
+}
+
+static void temper_sampler_start(struct usb_temper *temper_dev)
+{
+	if (READ_ONCE(temper_dev->sample_interval_ms))
+		schedule_delayed_work(&temper_dev->sample_work, 0);
+}
+
+/*
+ * Grid aligned sampling: a timer on the absolute grid clock fires ahead of
+ * each grid point by the lead, and a high priority work reads the sample.
+ * Points are skipped while the previous one is still being read.
+ */
+static enum hrtimer_restart temper_grid_expire(struct usb_temper *temper_dev,
+					       struct hrtimer *timer)
+{
+	u64 now_ns = ktime_to_ns(hrtimer_cb_get_time(timer));
+	u64 period_ns, next_ns;
+
+	spin_lock(&temper_dev->lock);
+	period_ns = (u64)temper_dev->grid_ms * NSEC_PER_MSEC;
+	temper_dev->grid_due_ns = temper_dev->grid_next_ns;
+	if (!queue_work(system_highpri_wq, &temper_dev->grid_work))
+		temper_dev->grid_missed++;
+
+	next_ns = temper_grid_point(now_ns + temper_dev->grid_lead_ns + 1,
+				    period_ns);
+	temper_dev->grid_next_ns = max(next_ns,
+				       temper_dev->grid_next_ns + period_ns);
+	hrtimer_set_expires(timer, ns_to_ktime(temper_dev->grid_next_ns -
+					       temper_dev->grid_lead_ns));
+	spin_unlock(&temper_dev->lock);
+
+	return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart temper_grid_real_timer(struct hrtimer *timer)
+{
+	return temper_grid_expire(container_of(timer, struct usb_temper,
+					       grid_real_timer), timer);
+}
+
+static enum hrtimer_restart temper_grid_tai_timer(struct hrtimer *timer)
+{
+	return temper_grid_expire(container_of(timer, struct usb_temper,
+					       grid_tai_timer), timer);
+}
+
+/* Timers cannot change clock once set up, each clock has its own */
+static struct hrtimer *temper_grid_hrtimer(struct usb_temper *temper_dev)
+{
+	return temper_dev->grid_clock == CLOCK_TAI ?
+	       &temper_dev->grid_tai_timer : &temper_dev->grid_real_timer;
+}
+
+static void temper_grid_work(struct work_struct *work)
+{
+	struct usb_temper *temper_dev = container_of(work, struct usb_temper,
+						     grid_work);
+	u64 grid_ns;
+
+	spin_lock_irq(&temper_dev->lock);
+	grid_ns = temper_dev->grid_due_ns;
+	temper_dev->grid_pending_ns = grid_ns;
+	spin_unlock_irq(&temper_dev->lock);
+
+	get_temp_value(temper_dev, NULL);
+
+	/* In fast-fail, no transaction ran: the point is missed */
+	spin_lock_irq(&temper_dev->lock);
+	if (temper_dev->grid_pending_ns == grid_ns)
+		temper_dev->grid_pending_ns = 0;
+	spin_unlock_irq(&temper_dev->lock);
+}
+
+static void temper_grid_start(struct usb_temper *temper_dev)
+{
+	u64 period_ns, now_ns;
+	ktime_t expires;
+
+	if (!READ_ONCE(temper_dev->grid_ms))
+		return;
+
+	now_ns = ktime_to_ns(temper_dev->grid_clock == CLOCK_TAI ?
+			     ktime_get_clocktai() : ktime_get_real());
+
+	spin_lock_irq(&temper_dev->lock);
+	period_ns = (u64)temper_dev->grid_ms * NSEC_PER_MSEC;
+	if (!temper_dev->grid_lead_ns && temper_dev->tx_lat_count)
+		temper_dev->grid_lead_ns =
+			min(div64_u64(temper_dev->tx_lat_sum_us,
+				      temper_dev->tx_lat_count) * NSEC_PER_USEC,
+			    period_ns / 2);
+	temper_dev->grid_next_ns = temper_grid_point(now_ns +
+						     temper_dev->grid_lead_ns + 1,
+						     period_ns);
+	expires = ns_to_ktime(temper_dev->grid_next_ns - temper_dev->grid_lead_ns);
+	spin_unlock_irq(&temper_dev->lock);
+
+	hrtimer_start(temper_grid_hrtimer(temper_dev), expires, HRTIMER_MODE_ABS);
+}
+
+static void temper_grid_stop(struct usb_temper *temper_dev)
+{
+	hrtimer_cancel(&temper_dev->grid_real_timer);
+	hrtimer_cancel(&temper_dev->grid_tai_timer);
+	cancel_work_sync(&temper_dev->grid_work);
+}
+
+/*
+ * Read a sample for the TEMPER_URING_TRIGGER commands. Triggers arriving
+ * while the work is pending share its transaction.
+ */
+static void temper_uring_work(struct work_struct *work)
+{
+	struct usb_temper *temper_dev = container_of(work, struct usb_temper,
+						     uring_work);
+	int rc;
+
+	rc = get_temp_value(temper_dev, NULL);
+	if (rc)
+		temper_uring_fail(temper_dev, rc, true);
+}
+
+/* Background probe deciding when a failing device is healthy again */
+static void temper_health_work(struct work_struct *work)
+{
+	struct usb_temper *temper_dev = container_of(to_delayed_work(work),
+						     struct usb_temper,
+						     health_work);
+	unsigned int downtime_ms;
+	int rc;
+
+	mutex_lock(&temper_dev->io_mutex);
+	/* Under io_mutex, hence never in the middle of a reset */
+	if (temper_reset_forget(temper_dev))
+		printk(KERN_WARNING "temper: reset did not happen, probing anyway\n");
+	rc = temper_transaction(temper_dev, TEMPER_TIMEOUT_MAX_MS);
+	if (!rc) {
+		spin_lock_irq(&temper_dev->lock);
+		downtime_ms = ktime_ms_delta(temper_dev->last_good,
+					     temper_dev->fault_start);
+		temper_dev->health = TEMPER_HEALTHY;
+		temper_dev->recoveries++;
+		temper_dev->last_downtime_ms = downtime_ms;
+		temper_dev->total_downtime_ms += downtime_ms;
+		spin_unlock_irq(&temper_dev->lock);
+		printk(KERN_INFO "temper: device is healthy again after %u ms\n",
+		       downtime_ms);
+	}
+	mutex_unlock(&temper_dev->io_mutex);
+
+	/* A reset just queued has armed the probe already */
+	if (rc && !READ_ONCE(temper_dev->reset_pending))
+		schedule_delayed_work(&temper_dev->health_work,
+				      msecs_to_jiffies(probe_interval_ms));
+}
+
+/* State file */
+static ssize_t show_temperatures(struct device *dev, struct device_attribute *attr, 
+			   char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	struct temper_sample_ts ts;
+
+	if (temper_client_get(&temper_dev->sysfs_client, &ts, false) ==
+	    -ERESTARTSYS)
+		return -ERESTARTSYS;
+
+	return temper_sprint_sample(buf, &ts);
+}
+static DEVICE_ATTR(temperatures, S_IRUGO, show_temperatures, NULL);
+
+static ssize_t show_model(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	const struct temper_model *model = temper_dev->model;
+
+	return sprintf(buf, "name: %s\ntemperatures: %u\nhumidity: %s\n",
+		       model->name, model->channels,
+		       model->humidity ? "yes" : "no");
+}
+static DEVICE_ATTR(model, S_IRUGO, show_model, NULL);
+
+/* Health file, never triggers a USB transaction */
+static ssize_t show_health(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	struct temper_sample_ts ts;
+	ssize_t len;
+
+	spin_lock_irq(&temper_dev->lock);
+	temper_fill_sample(temper_dev, &ts);
+	len = sprintf(buf, "state: %s\nconsecutive_failures: %u\n"
+		      "timeout_ms: %u\nlatency_p99_us: %u\n"
+		      "resets: %u\nrecoveries: %u\n"
+		      "last_downtime_ms: %u\ntotal_downtime_ms: %llu\n"
+		      "transactions: %lu\ncoalesced: %llu\n"
+		      "deliveries: %llu\nsuppressed: %llu\n",
+		      temper_dev->health == TEMPER_HEALTHY ? "ok" :
+		      temper_dev->reset_pending ? "resetting" : "fast-fail",
+		      temper_dev->fail_count, temper_dev->timeout_ms,
+		      temper_dev->lat_p99_us, temper_dev->resets,
+		      temper_dev->recoveries, temper_dev->last_downtime_ms,
+		      temper_dev->total_downtime_ms, temper_dev->tx_done,
+		      temper_dev->tx_coalesced, temper_dev->deliveries,
+		      temper_dev->suppressed);
+	spin_unlock_irq(&temper_dev->lock);
+
+	if (ts.sample.flags & TEMPER_SAMPLE_VALID)
+		len += sprintf(buf + len, "sample_age_ms: %u\n", ts.sample.age_ms);
+	else
+		len += sprintf(buf + len, "sample_age_ms: none\n");
+
+	return len;
+}
+
+/* Timing file, never triggers a USB transaction */
+static ssize_t show_timing(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	ssize_t len;
+
+	spin_lock_irq(&temper_dev->lock);
+	len = sprintf(buf, "last_sample_ns: %llu\nlast_sample_realtime_ns: %llu\n"
+		      "last_frame: %d\n"
+		      "latency_us: %llu samples, min %u avg %llu max %u\n"
+		      "interval_us: %llu samples, min %u avg %llu max %u\n"
+		      "jitter_us: %u\njitter_max_us: %u\n"
+		      "grid_lead_us: %lld\ngrid_samples: %llu\ngrid_missed: %llu\n"
+		      "grid_error_ns: last %lld mean_abs %llu max_abs %llu\n",
+		      temper_dev->sample_ns, temper_dev->sample_real_ns,
+		      temper_dev->sample_frame == TEMPER_NO_FRAME ? -1 :
+		      (int)temper_dev->sample_frame,
+		      temper_dev->tx_lat_count, temper_dev->tx_lat_min_us,
+		      temper_dev->tx_lat_count ?
+		      div64_u64(temper_dev->tx_lat_sum_us, temper_dev->tx_lat_count) : 0,
+		      temper_dev->tx_lat_max_us,
+		      temper_dev->iv_count, temper_dev->iv_min_us,
+		      temper_dev->iv_count ?
+		      div64_u64(temper_dev->iv_sum_us, temper_dev->iv_count) : 0,
+		      temper_dev->iv_max_us,
+		      temper_dev->jitter16_us >> 4, temper_dev->jitter_max_us,
+		      div_s64(temper_dev->grid_lead_ns, NSEC_PER_USEC),
+		      temper_dev->grid_samples, temper_dev->grid_missed,
+		      temper_dev->sample_grid_err_ns,
+		      temper_dev->grid_samples ?
+		      div64_u64(temper_dev->grid_err_abs_sum_ns,
+				temper_dev->grid_samples) : 0,
+		      temper_dev->grid_err_abs_max_ns);
+	if (temper_dev->has_sample)
+		len += sprintf(buf + len, "probe_to_first_sample_us: %llu\n",
+			       temper_dev->first_sample_us);
+	else
+		len += sprintf(buf + len, "probe_to_first_sample_us: none\n");
+	spin_unlock_irq(&temper_dev->lock);
+
+	return len;
+}
+static DEVICE_ATTR(timing, S_IRUGO, show_timing, NULL);
+static DEVICE_ATTR(health, S_IRUGO, show_health, NULL);
+
+/* Memory held for this device, open files and queued commands included */
+static ssize_t show_allocations(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "objects: %ld\nbytes: %ld\n",
+		       atomic_long_read(&temper_dev->alloc_objects),
+		       atomic_long_read(&temper_dev->alloc_bytes));
+}
+static DEVICE_ATTR(allocations, S_IRUGO, show_allocations, NULL);
+
+/* Power management file */
+static ssize_t show_pm(struct device *dev, struct device_attribute *attr,
+		       char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	unsigned long long suspended_ms;
+	ssize_t len;
+
+	spin_lock_irq(&temper_dev->lock);
+	suspended_ms = temper_dev->pm_suspended_ms;
+	if (temper_dev->pm_suspends != temper_dev->pm_resumes)
+		suspended_ms += ktime_ms_delta(ktime_get(),
+					       temper_dev->pm_suspended_at);
+	len = sprintf(buf, "suspends: %u\nresumes: %u\nsuspended_ms: %llu\n"
+		      "resume_waits: %u\nresume_latency_avg_us: %llu\n"
+		      "resume_latency_max_us: %u\n",
+		      temper_dev->pm_suspends, temper_dev->pm_resumes,
+		      suspended_ms, temper_dev->pm_resume_waits,
+		      temper_dev->pm_resume_waits ?
+		      div_u64(temper_dev->pm_resume_lat_us,
+			      temper_dev->pm_resume_waits) : 0,
+		      temper_dev->pm_resume_lat_max_us);
+	spin_unlock_irq(&temper_dev->lock);
+
+	return len;
+}
+static DEVICE_ATTR(pm, S_IRUGO, show_pm, NULL);
+
+/* Background sampling period, 0 stops the sampler */
+static ssize_t show_sample_interval_ms(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%u\n", READ_ONCE(temper_dev->sample_interval_ms));
+}
+
+static ssize_t store_sample_interval_ms(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	unsigned int interval_ms;
+	int rc;
+
+	rc = kstrtouint(buf, 0, &interval_ms);
+	if (rc)
+		return rc;
+
+	cancel_delayed_work_sync(&temper_dev->sample_work);
+	WRITE_ONCE(temper_dev->sample_interval_ms, interval_ms);
+	temper_sampler_start(temper_dev);
+
+	return count;
+}
+static DEVICE_ATTR(sample_interval_ms, S_IRUGO | S_IWUSR,
+		   show_sample_interval_ms, store_sample_interval_ms);
+
+/*
+ * Grid aligned sampling file: "<period_ms> [realtime|tai]", 0 disables.
+ * The period is at least TEMPER_GRID_MIN_MS and twice the mean latency.
+ */
+static ssize_t show_sample_grid(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+
+	return sprintf(buf, "%u %s\n", READ_ONCE(temper_dev->grid_ms),
+		       temper_dev->grid_clock == CLOCK_TAI ? "tai" : "realtime");
+}
+
+static ssize_t store_sample_grid(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	clockid_t clock = temper_dev->grid_clock;
+	unsigned int grid_ms, lat_avg_us = 0;
+	char name[9];
+	int n;
+
+	n = sscanf(buf, "%u %8s", &grid_ms, name);
+	if (n < 1)
+		return -EINVAL;
+	if (n == 2) {
+		if (!strcmp(name, "realtime"))
+			clock = CLOCK_REALTIME;
+		else if (!strcmp(name, "tai"))
+			clock = CLOCK_TAI;
+		else
+			return -EINVAL;
+	}
+
+	/* Each point costs a transaction, shorter periods would only miss */
+	spin_lock_irq(&temper_dev->lock);
+	if (temper_dev->tx_lat_count)
+		lat_avg_us = div64_u64(temper_dev->tx_lat_sum_us,
+				       temper_dev->tx_lat_count);
+	spin_unlock_irq(&temper_dev->lock);
+	if (grid_ms && (grid_ms < TEMPER_GRID_MIN_MS ||
+			grid_ms * 1000ULL < 2ULL * lat_avg_us))
+		return -EINVAL;
+
+	mutex_lock(&temper_dev->grid_mutex);
+	temper_grid_stop(temper_dev);
+	spin_lock_irq(&temper_dev->lock);
+	temper_dev->grid_ms = grid_ms;
+	temper_dev->grid_clock = clock;
+	spin_unlock_irq(&temper_dev->lock);
+	temper_grid_start(temper_dev);
+	mutex_unlock(&temper_dev->grid_mutex);
+
+	return count;
+}
+static DEVICE_ATTR(sample_grid, S_IRUGO | S_IWUSR,
+		   show_sample_grid, store_sample_grid);
 
-static int get_temp_value (struct usb_temper *temper_dev)
+/* Transport file, lists the transports with the current one in brackets */
+static ssize_t show_transport(struct device *dev, struct device_attribute *attr,
+			      char *buf)
 {
-	int rc = 0;
-	int l;
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	const struct temper_transport *cur = READ_ONCE(temper_dev->transport);
+	ssize_t len = 0;
+	int i;
 
-	memset(temper_dev->int_in_buffer, 0, TEMPER_INT_BUFFER_SIZE);
+	for (i = 0; i < ARRAY_SIZE(temper_transports); i++)
+		len += sprintf(buf + len, &temper_transports[i] == cur ?
+			       "[%s] " : "%s ", temper_transports[i].name);
+	buf[len - 1] = '\n';
 
-	rc = usb_control_msg(temper_dev->udev,
-		usb_sndctrlpipe(temper_dev->udev, 0),
-		TEMPER_CTRL_REQUEST,
-		TEMPER_CTRL_REQUEST_TYPE,
-		TEMPER_CTRL_VALUE,
-		TEMPER_CTRL_INDEX,
-		temper_dev->ctrl_out_buffer,
-		TEMPER_CTRL_BUFFER_SIZE,
-		HZ * 2);
+	return len;
+}
 
-	if (rc < 0) {
-	        printk(KERN_ERR "temper: control message failed (%d)", rc);
-		return rc;
-        }
+static ssize_t store_transport(struct device *dev, struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	const struct temper_transport *t;
+	int rc;
 
-	rc = usb_interrupt_msg (temper_dev->udev,
-		usb_rcvintpipe(temper_dev->udev, 2),
-		temper_dev->int_in_buffer,
-		TEMPER_INT_BUFFER_SIZE,
-		&l,
-		2 * HZ);
-	if (rc < 0) {
-	        printk(KERN_ERR "temper: interrupt message failed (%d)", rc);
-	        temper_dev->temp_in = -1;
-	        temper_dev->temp_out = -1;
+	t = temper_find_transport(buf);
+	if (!t)
+		return -EINVAL;
+
+	/* Keep the device awake, start() and stop() race with PM otherwise */
+	rc = usb_autopm_get_interface(intf);
+	if (rc)
 		return rc;
-        }
 
-	temper_dev->temp_in =
-		(temper_dev->int_in_buffer[3] & 0xff) + 
-		((temper_dev->int_in_buffer[2] & 0xff) << 8); /* Raw */
-	temper_dev->temp_in *= 125 / 32; /* m°C */
+	mutex_lock(&temper_dev->io_mutex);
+	if (temper_dev->bench_running) {
+		rc = -EBUSY;
+	} else if (t != temper_dev->transport) {
+		temper_transport_teardown(temper_dev);
+		rc = temper_transport_setup(temper_dev, t);
+	}
+	mutex_unlock(&temper_dev->io_mutex);
 
-	temper_dev->temp_out =
-		(temper_dev->int_in_buffer[5] & 0xff) + 
-		((temper_dev->int_in_buffer[4] & 0xff) << 8); /* Raw */
-	temper_dev->temp_out *= 125 / 32; /* m°C */
+	usb_autopm_put_interface(intf);
 
-	return rc;
+	return rc ? rc : count;
 }
+static DEVICE_ATTR(transport, S_IRUGO | S_IWUSR, show_transport, store_transport);
 
-/* State file */
-static ssize_t show_temperatures(struct device *dev, struct device_attribute *attr, 
-			   char *buf)
+/*
+ * Self-benchmark, writing N runs N transactions with each transport.
+ * io_mutex is released between transactions, other readers keep being
+ * served with the transport under test.
+ *
+ * The CPU cost is the runtime of the calling task plus the time spent in
+ * completion handlers. The task runtime is only brought up to date when
+ * it is scheduled out or on a scheduler tick: a single run may be off by
+ * up to a tick, the average over many runs is what to look at.
+ */
+static void temper_bench_one(struct usb_temper *temper_dev,
+			     const struct temper_transport *t,
+			     unsigned int runs, struct temper_bench *bench)
+{
+	u64 cpu_ns = 0, cb_ns, task_ns, total_us = 0;
+	unsigned int i, lat_us;
+	ktime_t start;
+	int rc;
+
+	memset(bench, 0, sizeof(*bench));
+
+	if (temper_transport_setup(temper_dev, t)) {
+		bench->errors = runs;
+		return;
+	}
+
+	task_ns = current->se.sum_exec_runtime;
+
+	for (i = 0; i < runs; i++) {
+		if (i) {
+			mutex_unlock(&temper_dev->io_mutex);
+			cond_resched();
+			mutex_lock(&temper_dev->io_mutex);
+		}
+
+		/* Handlers of the transactions of other readers do not count */
+		cb_ns = atomic64_read(&temper_dev->cb_ns);
+		start = ktime_get();
+		rc = t->xfer(temper_dev, TEMPER_TIMEOUT_MAX_MS);
+		lat_us = ktime_us_delta(ktime_get(), start);
+		cpu_ns += atomic64_read(&temper_dev->cb_ns) - cb_ns;
+		if (rc < TEMPER_INT_BUFFER_SIZE) {
+			bench->errors++;
+			continue;
+		}
+
+		if (!bench->runs || lat_us < bench->lat_min_us)
+			bench->lat_min_us = lat_us;
+		bench->lat_max_us = max(bench->lat_max_us, lat_us);
+		total_us += lat_us;
+		bench->runs++;
+	}
+
+	cpu_ns += current->se.sum_exec_runtime - task_ns;
+	bench->cpu_avg_us = div_u64(cpu_ns, runs * 1000);
+	if (bench->runs)
+		bench->lat_avg_us = div_u64(total_us, bench->runs);
+
+	temper_transport_teardown(temper_dev);
+}
+
+static ssize_t show_benchmark(struct device *dev, struct device_attribute *attr,
+			      char *buf)
 {
 	struct usb_interface *intf = to_usb_interface(dev);
 	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	struct temper_bench *bench;
+	ssize_t len;
+	int i;
 
-	get_temp_value(temper_dev);
+	mutex_lock(&temper_dev->io_mutex);
+	len = sprintf(buf, "transport runs errors lat_min_us lat_avg_us lat_max_us cpu_avg_us\n");
+	for (i = 0; i < ARRAY_SIZE(temper_transports); i++) {
+		bench = &temper_dev->bench[i];
+		len += sprintf(buf + len, "%s %u %u %u %u %u %u\n",
+			       temper_transports[i].name, bench->runs,
+			       bench->errors, bench->lat_min_us,
+			       bench->lat_avg_us, bench->lat_max_us,
+			       bench->cpu_avg_us);
+	}
+	mutex_unlock(&temper_dev->io_mutex);
 
-	return sprintf(buf, "Temperature in:  %3d.%03d°C\nTemperature out: %3d.%03d°C\n",
-		       temper_dev->temp_in / 1000, temper_dev->temp_in % 1000,
-		       temper_dev->temp_out / 1000, temper_dev->temp_out % 1000);
+	return len;
 }
-static DEVICE_ATTR(temperatures, S_IRUGO, show_temperatures, NULL);
+
+static ssize_t store_benchmark(struct device *dev, struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usb_temper *temper_dev = usb_get_intfdata(intf);
+	const struct temper_transport *cur;
+	unsigned int runs;
+	int rc, i;
+
+	rc = kstrtouint(buf, 0, &runs);
+	if (rc)
+		return rc;
+	if (!runs || runs > TEMPER_BENCH_MAX_RUNS)
+		return -EINVAL;
+
+	rc = usb_autopm_get_interface(intf);
+	if (rc)
+		return rc;
+
+	mutex_lock(&temper_dev->io_mutex);
+	if (temper_dev->bench_running) {
+		rc = -EBUSY;
+		goto unlock;
+	}
+	temper_dev->bench_running = true;
+	cur = temper_dev->transport;
+	temper_transport_teardown(temper_dev);
+	for (i = 0; i < ARRAY_SIZE(temper_transports); i++)
+		temper_bench_one(temper_dev, &temper_transports[i], runs,
+				 &temper_dev->bench[i]);
+	rc = temper_transport_setup(temper_dev, cur);
+	temper_dev->bench_running = false;
+unlock:
+	mutex_unlock(&temper_dev->io_mutex);
+
+	usb_autopm_put_interface(intf);
+
+	return rc ? rc : count;
+}
+static DEVICE_ATTR(benchmark, S_IRUGO | S_IWUSR, show_benchmark, store_benchmark);
+
+/* Last reference dropped: the interface is unbound and no file is open */
+static void temper_delete(struct kref *kref)
+{
+	struct usb_temper *temper_dev = container_of(kref, struct usb_temper,
+						     kref);
+
+	temper_free(temper_dev, temper_dev->int_in_buffer,
+		    temper_dev->int_in_size);
+	temper_free(temper_dev, temper_dev->ctrl_out_buffer,
+		    TEMPER_CTRL_BUFFER_SIZE);
+	usb_put_dev(temper_dev->udev);
+
+	temper_account(temper_dev, -(long)sizeof(*temper_dev), -1);
+	kfree(temper_dev);
+}
+
+/* Char device operations */
+static int temper_open(struct inode *inode, struct file *file)
+{
+	struct usb_interface *intf;
+	struct usb_temper *temper_dev;
+	struct temper_client *client;
+	int minor;
+
+	minor = iminor(inode);
+
+	/* Get interface with minor */
+	intf = usb_find_interface(&temper_driver, minor);
+	if (!intf) {
+		printk(KERN_WARNING "temper: cannot find USB interface\n");
+		return -ENODEV;
+	}
+
+	/* Get private data from interface */
+	temper_dev = usb_get_intfdata (intf);
+	if (!temper_dev) {
+		printk (KERN_WARNING "temper: cannot find device for minor %d\n", minor);
+		return -ENODEV;
+	}
+
+	/* The minor cannot be deregistered while opening, the device is alive */
+	kref_get(&temper_dev->kref);
+
+	/* Per file state, saved for further use */
+	client = temper_alloc(temper_dev, sizeof(*client));
+	if (!client) {
+		kref_put(&temper_dev->kref, temper_delete);
+		return -ENOMEM;
+	}
+
+	temper_client_init(client, temper_dev);
+	file->private_data = client;
+
+	spin_lock_irq(&temper_dev->lock);
+	list_add_tail(&client->node, &temper_dev->clients);
+	spin_unlock_irq(&temper_dev->lock);
+
+	return 0;
+}
+
+/*
+ * Read ioctls. In fast-fail, the last good sample is returned along with
+ * -EAGAIN. Without any sample to return, as for a non-blocking client
+ * over budget before the first good read, -EAGAIN comes alone.
+ */
+static long temper_ioctl_sample(struct temper_client *client,
+				unsigned int cmd, unsigned long arg,
+				bool nonblock)
+{
+	struct temper_sample_ts ts;
+	int rc;
+
+	if (cmd == TEMPER_IOR_HUMIDITY && !client->temper_dev->model->humidity)
+		return -EINVAL;
+
+	memset(&ts, 0, sizeof(ts));
+	rc = temper_client_get(client, &ts, nonblock);
+	if (rc && rc != -EAGAIN)
+		return rc;
+	if (rc && !(ts.sample.flags & TEMPER_SAMPLE_VALID))
+		return rc;
+
+	if (temper_ioctl_put(cmd, arg, &ts))
+		return -EFAULT;
+
+	return rc;
+}
+
+static long temper_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct temper_client *client;
+	struct temper_client_stats stats;
+	struct temper_deadband deadband;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+
+	/* Retrieve the client structure */
+	client = file->private_data;
+	if (!client || READ_ONCE(client->temper_dev->gone))
+		return -ENODEV;
+
+	if (temper_ioctl_is_read(cmd))
+		return temper_ioctl_sample(client, cmd, arg, nonblock);
+
+	switch (cmd) {
+	case TEMPER_IOW_DEADBAND:
+		if (copy_from_user(&deadband, (void __user *)arg,
+				   sizeof(deadband)))
+			return -EFAULT;
+		if (deadband.flags & ~TEMPER_DEADBAND_ENABLE)
+			return -EINVAL;
+		spin_lock_irq(&client->temper_dev->lock);
+		client->deadband = deadband;
+		spin_unlock_irq(&client->temper_dev->lock);
+		break;
+	case TEMPER_IOR_CLIENT_STATS:
+		spin_lock_irq(&client->temper_dev->lock);
+		stats = client->stats;
+		spin_unlock_irq(&client->temper_dev->lock);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		break;
+	default:
+		printk(KERN_ERR "Unknown command %d\n", cmd);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int temper_release(struct inode *inode, struct file *file)
+{
+	struct temper_client *client = file->private_data;
+	struct usb_temper *temper_dev = client->temper_dev;
+
+	spin_lock_irq(&temper_dev->lock);
+	list_del(&client->node);
+	spin_unlock_irq(&temper_dev->lock);
+
+	temper_free(temper_dev, client, sizeof(*client));
+	kref_put(&temper_dev->kref, temper_delete);
+
+	return 0;
+}
+
+/*
+ * Samples taken by the sampler or on behalf of any client are delivered,
+ * read() does not trigger a transaction.
+ */
+static ssize_t temper_read(struct file *file, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	struct temper_client *client = file->private_data;
+	struct usb_temper *temper_dev = client->temper_dev;
+	struct temper_sample_ts ts;
+
+	if (count < sizeof(ts))
+		return -EINVAL;
+
+	spin_lock_irq(&temper_dev->lock);
+	while (!client->pending) {
+		spin_unlock_irq(&temper_dev->lock);
+		if (READ_ONCE(temper_dev->gone))
+			return -ENODEV;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(client->wq,
+					     READ_ONCE(client->pending) ||
+					     READ_ONCE(temper_dev->gone)))
+			return -ERESTARTSYS;
+		spin_lock_irq(&temper_dev->lock);
+	}
+	ts = client->next;
+	client->pending = false;
+	spin_unlock_irq(&temper_dev->lock);
+
+	if (copy_to_user(buf, &ts, sizeof(ts)))
+		return -EFAULT;
+
+	return sizeof(ts);
+}
+
+static __poll_t temper_poll(struct file *file, poll_table *wait)
+{
+	struct temper_client *client = file->private_data;
+
+	poll_wait(file, &client->wq, wait);
+
+	if (READ_ONCE(client->pending))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return READ_ONCE(client->temper_dev->gone) ? EPOLLHUP | EPOLLERR : 0;
+}
+
+/* Last sample, right away */
+static int temper_uring_latest(struct usb_temper *temper_dev,
+			       void __user *addr)
+{
+	struct temper_sample_ts ts;
+
+	spin_lock_irq(&temper_dev->lock);
+	temper_fill_sample(temper_dev, &ts);
+	spin_unlock_irq(&temper_dev->lock);
+
+	if (copy_to_user(addr, &ts, sizeof(ts)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Up to @count last samples, newest first */
+static int temper_uring_history(struct usb_temper *temper_dev,
+				void __user *addr, unsigned int count)
+{
+	struct temper_sample_ts *records;
+	unsigned int i, n, slot;
+	int rc;
+
+	count = min_t(unsigned int, count, TEMPER_HISTORY_SIZE);
+	if (!count)
+		return 0;
+
+	records = kmalloc_array(count, sizeof(*records), GFP_KERNEL);
+	if (!records)
+		return -ENOMEM;
+
+	spin_lock_irq(&temper_dev->lock);
+	n = min(count, temper_dev->history_len);
+	slot = temper_dev->history_head;
+	for (i = 0; i < n; i++) {
+		slot = (slot + TEMPER_HISTORY_SIZE - 1) % TEMPER_HISTORY_SIZE;
+		records[i] = temper_dev->history[slot];
+	}
+	spin_unlock_irq(&temper_dev->lock);
+
+	rc = copy_to_user(addr, records, n * sizeof(*records)) ? -EFAULT : n;
+	kfree(records);
+
+	return rc;
+}
+
+/*
+ * Queue the command until the next sample lands. Triggers are charged to
+ * the file like the read ioctls: over budget, they are served from the
+ * cache, or wait for the next sample if there is none yet.
+ */
+static int temper_uring_queue(struct io_uring_cmd *cmd,
+			      struct temper_client *client, void __user *addr,
+			      u32 flags, unsigned int issue_flags)
+{
+	struct usb_temper *temper_dev = client->temper_dev;
+	struct temper_uring_wait *wait;
+	struct temper_sample_ts ts;
+
+	if (flags & TEMPER_URING_TRIGGER) {
+		spin_lock_irq(&temper_dev->lock);
+		client->stats.requests++;
+		if (!temper_client_take_token(client)) {
+			client->stats.transactions++;
+		} else if (temper_dev->has_sample) {
+			client->stats.cached++;
+			temper_fill_sample(temper_dev, &ts);
+			ts.sample.flags |= TEMPER_SAMPLE_CACHED;
+			spin_unlock_irq(&temper_dev->lock);
+			return copy_to_user(addr, &ts, sizeof(ts)) ? -EFAULT : 0;
+		} else {
+			client->stats.throttled++;
+			flags &= ~TEMPER_URING_TRIGGER;
+		}
+		spin_unlock_irq(&temper_dev->lock);
+	}
+
+	wait = temper_alloc(temper_dev, sizeof(*wait));
+	if (!wait)
+		return -ENOMEM;
+
+	wait->temper_dev = temper_dev;
+	wait->cmd = cmd;
+	wait->addr = addr;
+	wait->trigger = flags & TEMPER_URING_TRIGGER;
+	temper_uring_pdu(cmd)->wait = wait;
+
+	/* May take the ring lock when issued from io-wq, so not under ours */
+	io_uring_cmd_mark_cancelable(cmd, issue_flags);
+
+	spin_lock_irq(&temper_dev->lock);
+	if (temper_dev->gone) {
+		spin_unlock_irq(&temper_dev->lock);
+		temper_free(temper_dev, wait, sizeof(*wait));
+		/* Cancelable now, only completing takes it off the ring */
+		io_uring_cmd_done(cmd, -ENODEV, 0, issue_flags);
+		return -EIOCBQUEUED;
+	}
+	list_add_tail(&wait->node, &temper_dev->uring_waits);
+	wait->queued = true;
+	if (wait->trigger)
+		queue_work(system_wq, &temper_dev->uring_work);
+	spin_unlock_irq(&temper_dev->lock);
+
+	return -EIOCBQUEUED;
+}
+
+/* The ring goes away with the command still queued */
+static void temper_uring_cancel(struct io_uring_cmd *cmd,
+				struct usb_temper *temper_dev,
+				unsigned int issue_flags)
+{
+	struct temper_uring_wait *wait = temper_uring_pdu(cmd)->wait;
+	bool queued;
+
+	/*
+	 * Once out of uring_waits, the command sits on the private list of
+	 * its completer: leave it alone, completion is already on its way.
+	 */
+	spin_lock_irq(&temper_dev->lock);
+	queued = wait->queued;
+	if (queued) {
+		wait->queued = false;
+		list_del_init(&wait->node);
+	}
+	spin_unlock_irq(&temper_dev->lock);
+
+	if (queued) {
+		temper_free(temper_dev, wait, sizeof(*wait));
+		io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+	}
+}
+
+/*
+ * Commands are submitted in batches over many devices from a single
+ * thread, the waiting ones completing as samples land.
+ */
+static int temper_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	struct temper_client *client = cmd->file->private_data;
+	struct usb_temper *temper_dev = client->temper_dev;
+	const struct temper_uring_cmd *ucmd = io_uring_sqe_cmd(cmd->sqe);
+	void __user *addr;
+	u32 flags;
+
+	if (issue_flags & IO_URING_F_CANCEL) {
+		temper_uring_cancel(cmd, temper_dev, issue_flags);
+		return 0;
+	}
+
+	/* Cached data included, like the ioctls */
+	if (READ_ONCE(temper_dev->gone))
+		return -ENODEV;
+
+	addr = u64_to_user_ptr(READ_ONCE(ucmd->addr));
+	flags = READ_ONCE(ucmd->flags);
+
+	switch (cmd->cmd_op) {
+	case TEMPER_URING_CMD_SAMPLE:
+		if (flags & ~(TEMPER_URING_WAIT | TEMPER_URING_TRIGGER))
+			return -EINVAL;
+		if (!flags)
+			return temper_uring_latest(temper_dev, addr);
+		return temper_uring_queue(cmd, client, addr, flags,
+					  issue_flags);
+	case TEMPER_URING_CMD_HISTORY:
+		if (flags)
+			return -EINVAL;
+		return temper_uring_history(temper_dev, addr,
+					    READ_ONCE(ucmd->count));
+	default:
+		return -ENOTTY;
+	}
+}
+
+static struct file_operations temper_fops = {
+	.owner = THIS_MODULE,
+	.open = temper_open,
+	.release = temper_release,
+	.read = temper_read,
+	.poll = temper_poll,
+	.unlocked_ioctl = temper_ioctl,
+	.uring_cmd = temper_uring_cmd,
+	.llseek = noop_llseek,
+};
+
+static struct usb_class_driver temper_class_driver = {
+	.name = "usb/temper%d",
+	.fops = &temper_fops,
+	.minor_base = 0
+};
 
 static int temper_probe(struct usb_interface *interface, 
 			const struct usb_device_id *id)
@@ -118,14 +2583,42 @@ static int temper_probe(struct usb_interface *interface,
 
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
+	const struct temper_transport *transport;
 
 	int rc = 0, i;
 
 	/* Alloc structure and init it */
-	temper_dev = kmalloc(sizeof(struct usb_temper), GFP_KERNEL);
-	memset(temper_dev, 0x00, sizeof(struct usb_temper));
+	temper_dev = kzalloc(sizeof(struct usb_temper), GFP_KERNEL);
+	if (!temper_dev)
+		return -ENOMEM;
+	kref_init(&temper_dev->kref);
+	temper_account(temper_dev, sizeof(struct usb_temper), 1);
+	temper_dev->probe_ns = ktime_get_ns();
 	temper_dev->udev = usb_get_dev(udev);
 	temper_dev->interface = interface;
+	temper_dev->model = temper_model_select(
+		(const struct temper_model *)id->driver_info, udev->product,
+		model_name);
+	spin_lock_init(&temper_dev->lock);
+	mutex_init(&temper_dev->io_mutex);
+	INIT_DELAYED_WORK(&temper_dev->health_work, temper_health_work);
+	INIT_DELAYED_WORK(&temper_dev->sample_work, temper_sample_work);
+	temper_dev->sample_interval_ms = sample_interval_ms;
+	temper_dev->timeout_ms = TEMPER_TIMEOUT_MAX_MS;
+	temper_dev->health = TEMPER_HEALTHY;
+	temper_client_init(&temper_dev->sysfs_client, temper_dev);
+	INIT_LIST_HEAD(&temper_dev->clients);
+	INIT_LIST_HEAD(&temper_dev->uring_waits);
+	INIT_WORK(&temper_dev->uring_work, temper_uring_work);
+	mutex_init(&temper_dev->grid_mutex);
+	hrtimer_setup(&temper_dev->grid_real_timer, temper_grid_real_timer,
+		      CLOCK_REALTIME, HRTIMER_MODE_ABS);
+	hrtimer_setup(&temper_dev->grid_tai_timer, temper_grid_tai_timer,
+		      CLOCK_TAI, HRTIMER_MODE_ABS);
+	INIT_WORK(&temper_dev->grid_work, temper_grid_work);
+	temper_dev->grid_clock = CLOCK_REALTIME;
+	init_completion(&temper_dev->int_done);
+	init_waitqueue_head(&temper_dev->stream_wq);
 
 	/* Retrieve endpoint configuration */
 	iface_desc = interface->cur_altsetting;
@@ -145,65 +2638,273 @@ static int temper_probe(struct usb_interface *interface,
 	if (!temper_dev->int_in_endpoint) {
 		printk(KERN_ERR "temper: could not find interrupt in endpoint");
 		rc = -ENODEV;
-		goto exit_err;
+		goto put_dev;
 	}
 
-	/* Alloc in and out buffers */
-	temper_dev->ctrl_out_buffer = kzalloc(TEMPER_CTRL_BUFFER_SIZE, GFP_KERNEL);
+	/* Alloc in and out buffers, freed with the structure */
+	temper_dev->ctrl_out_buffer = temper_alloc(temper_dev,
+						   TEMPER_CTRL_BUFFER_SIZE);
 	if (!temper_dev->ctrl_out_buffer) {
 		printk(KERN_ERR "temper: could not allocate ctrl_buffer");
 		rc = -ENOMEM;
-		goto exit_err;
+		goto put_dev;
 	}
-	memcpy(temper_dev->ctrl_out_buffer, temper_buf_get_temp, TEMPER_CTRL_BUFFER_SIZE);
+	memcpy(temper_dev->ctrl_out_buffer, temper_dev->model->command,
+	       TEMPER_CTRL_BUFFER_SIZE);
 
-	temper_dev->int_in_buffer = kmalloc(
-		le16_to_cpu(temper_dev->int_in_endpoint->wMaxPacketSize),
-		GFP_KERNEL);
+	/* Reports are always read whole */
+	temper_dev->int_in_size = max_t(unsigned int, TEMPER_INT_BUFFER_SIZE,
+		le16_to_cpu(temper_dev->int_in_endpoint->wMaxPacketSize));
+	temper_dev->int_in_buffer = temper_alloc(temper_dev,
+						 temper_dev->int_in_size);
 	if (!temper_dev->int_in_buffer) {
 		printk(KERN_ERR "temper: could not allocate int_in_buffer");
 		rc = -ENOMEM;
-		goto free_out_buf;
+		goto put_dev;
 	}
 
+	/* Transport */
+	transport = temper_find_transport(default_transport);
+	if (!transport) {
+		printk(KERN_WARNING "temper: unknown transport %s, using sync\n",
+		       default_transport);
+		transport = &temper_transports[0];
+	}
+	temper_transport_setup(temper_dev, transport);
+
 	/* Data */
 	temper_dev->temp_in = 0;
 	temper_dev->temp_out = 0;
-	get_temp_value(temper_dev);
+	temper_dev->humidity = 0;
 
 	/* Save interface data */
 	usb_set_intfdata(interface, temper_dev);
 
-	/* Create state file */
+	/* Create state files */
 	device_create_file(&interface->dev, &dev_attr_temperatures);
+	device_create_file(&interface->dev, &dev_attr_model);
+	device_create_file(&interface->dev, &dev_attr_health);
+	device_create_file(&interface->dev, &dev_attr_timing);
+	device_create_file(&interface->dev, &dev_attr_pm);
+	device_create_file(&interface->dev, &dev_attr_transport);
+	device_create_file(&interface->dev, &dev_attr_benchmark);
+	device_create_file(&interface->dev, &dev_attr_sample_interval_ms);
+	device_create_file(&interface->dev, &dev_attr_sample_grid);
+	device_create_file(&interface->dev, &dev_attr_allocations);
+
+	/* Let the stick sleep between samples */
+	if (autosuspend_delay_ms >= 0) {
+		pm_runtime_set_autosuspend_delay(&udev->dev,
+						 autosuspend_delay_ms);
+		usb_enable_autosuspend(udev);
+	}
+
+	printk(KERN_INFO "%s module now attached and configured\n",
+	       temper_dev->model->name);
+
+	/* Create char device */
+	temper_dev->miscdev.minor = MISC_DYNAMIC_MINOR;
+	temper_dev->miscdev.name = "temper";
+	temper_dev->miscdev.fops = &temper_fops;
+
+	rc = usb_register_dev(interface, &temper_class_driver);
+	if (rc < 0) {
+		printk(KERN_ERR "temper: cannot  register misc char device\n");
+		goto remove_files;
+	}
 
-	printk(KERN_INFO "TEMPer module now attached and configured\n");
+	/* Only now is the minor known, which the samples are published with */
+	get_temp_value(temper_dev, NULL);
+	temper_sampler_start(temper_dev);
 
 	return 0;
 
-free_out_buf:
-	kfree(temper_dev->ctrl_out_buffer);
-exit_err:
-	usb_put_dev(temper_dev->udev);
-	kfree(temper_dev);
+remove_files:
+	device_remove_file(&interface->dev, &dev_attr_allocations);
+	device_remove_file(&interface->dev, &dev_attr_sample_grid);
+	device_remove_file(&interface->dev, &dev_attr_sample_interval_ms);
+	device_remove_file(&interface->dev, &dev_attr_benchmark);
+	device_remove_file(&interface->dev, &dev_attr_transport);
+	device_remove_file(&interface->dev, &dev_attr_pm);
+	device_remove_file(&interface->dev, &dev_attr_timing);
+	device_remove_file(&interface->dev, &dev_attr_health);
+	device_remove_file(&interface->dev, &dev_attr_model);
+	device_remove_file(&interface->dev, &dev_attr_temperatures);
+	cancel_delayed_work_sync(&temper_dev->health_work);
+	temper_transport_teardown(temper_dev);
+	usb_set_intfdata(interface, NULL);
+put_dev:
+	kref_put(&temper_dev->kref, temper_delete);
 	return rc;
 }
 
+/*
+ * Power management. Transactions hold a PM reference, so nothing is in
+ * flight when autosuspending; the health probe takes its own reference and
+ * may keep running. On system sleep it is stopped and restarted on resume.
+ * The stick keeps no state between samples, a reset resume is a resume.
+ *
+ * Never take io_mutex here: a transaction holding it may be waiting for
+ * the resume to complete.
+ */
+static int temper_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct usb_temper *temper_dev = usb_get_intfdata(interface);
+
+	if (!temper_dev)
+		return 0;
+
+	if (!PMSG_IS_AUTO(message)) {
+		cancel_delayed_work_sync(&temper_dev->sample_work);
+		temper_grid_stop(temper_dev);
+		cancel_delayed_work_sync(&temper_dev->health_work);
+		temper_dev->system_sleep = true;
+	}
+
+	temper_transport_stop(temper_dev);
+
+	spin_lock_irq(&temper_dev->lock);
+	temper_dev->pm_suspends++;
+	temper_dev->pm_suspended_at = ktime_get();
+	spin_unlock_irq(&temper_dev->lock);
+
+	return 0;
+}
+
+static int temper_resume(struct usb_interface *interface)
+{
+	struct usb_temper *temper_dev = usb_get_intfdata(interface);
+	bool failing;
+
+	if (!temper_dev)
+		return 0;
+
+	temper_transport_start(temper_dev);
+
+	/*
+	 * Works are only stopped on system sleep. On runtime resume, one of
+	 * them is probably the reason why the device is woken up.
+	 */
+	if (!temper_dev->system_sleep)
+		goto out;
+	temper_dev->system_sleep = false;
+
+	spin_lock_irq(&temper_dev->lock);
+	failing = temper_dev->health != TEMPER_HEALTHY;
+	spin_unlock_irq(&temper_dev->lock);
+
+	if (failing)
+		schedule_delayed_work(&temper_dev->health_work, 0);
+	temper_sampler_start(temper_dev);
+	temper_grid_start(temper_dev);
+
+out:
+	spin_lock_irq(&temper_dev->lock);
+	temper_dev->pm_resumes++;
+	temper_dev->pm_suspended_ms += ktime_ms_delta(ktime_get(),
+						      temper_dev->pm_suspended_at);
+	spin_unlock_irq(&temper_dev->lock);
+
+	return 0;
+}
+
+/* Reset hooks, the device is quiesced while being reset */
+static int temper_pre_reset(struct usb_interface *interface)
+{
+	struct usb_temper *temper_dev = usb_get_intfdata(interface);
+
+	mutex_lock(&temper_dev->io_mutex);
+	/* The probe may be waiting for io_mutex, cannot wait for it */
+	cancel_delayed_work(&temper_dev->health_work);
+	temper_transport_stop(temper_dev);
+
+	return 0;
+}
+
+static int temper_post_reset(struct usb_interface *interface)
+{
+	struct usb_temper *temper_dev = usb_get_intfdata(interface);
+	bool failing, ours = false;
+
+	/* Latencies measured before the reset are meaningless now */
+	temper_dev->lat_count = 0;
+	temper_dev->lat_head = 0;
+	temper_dev->timeout_ms = TEMPER_TIMEOUT_MAX_MS;
+
+	spin_lock_irq(&temper_dev->lock);
+	if (temper_dev->reset_pending) {
+		temper_dev->reset_pending = false;
+		temper_dev->fail_count = 0;
+		ours = true;
+	}
+	/* A failing device stays in fast-fail until the probe succeeds */
+	failing = temper_dev->health != TEMPER_HEALTHY;
+	spin_unlock_irq(&temper_dev->lock);
+
+	temper_transport_start(temper_dev);
+	mutex_unlock(&temper_dev->io_mutex);
+
+	/* Taken when queueing the reset */
+	if (ours)
+		usb_autopm_put_interface_async(interface);
+	if (failing)
+		mod_delayed_work(system_wq, &temper_dev->health_work, 0);
+
+	return 0;
+}
+
 static void temper_disconnect(struct usb_interface *interface)
 {
 	struct usb_temper *temper_dev;
+	struct temper_client *client;
 
 	temper_dev = usb_get_intfdata(interface);
 
-	/* Remove state file */
+	/* Remove char device */
+	usb_deregister_dev(interface, &temper_class_driver);
+
+	/* Remove state files */
+	device_remove_file(&interface->dev, &dev_attr_allocations);
+	device_remove_file(&interface->dev, &dev_attr_sample_grid);
+	device_remove_file(&interface->dev, &dev_attr_sample_interval_ms);
+	device_remove_file(&interface->dev, &dev_attr_benchmark);
+	device_remove_file(&interface->dev, &dev_attr_transport);
+	device_remove_file(&interface->dev, &dev_attr_pm);
+	device_remove_file(&interface->dev, &dev_attr_timing);
+	device_remove_file(&interface->dev, &dev_attr_health);
+	device_remove_file(&interface->dev, &dev_attr_model);
 	device_remove_file(&interface->dev, &dev_attr_temperatures);
 
-	/* Free interface data */
-	kfree(temper_dev->ctrl_out_buffer);
-	usb_put_dev(temper_dev->udev);
+	/*
+	 * Open files may outlive the device: once the transaction in flight
+	 * is over, fail the next ones and wake up the readers.
+	 */
+	mutex_lock(&temper_dev->io_mutex);
+	spin_lock_irq(&temper_dev->lock);
+	temper_dev->gone = true;
+	list_for_each_entry(client, &temper_dev->clients, node)
+		wake_up_interruptible(&client->wq);
+	spin_unlock_irq(&temper_dev->lock);
+	mutex_unlock(&temper_dev->io_mutex);
 
-	/* Free device structure */
-	kfree(temper_dev);
+	/*
+	 * Stop the samplers, the health probe and the io_uring commands. The
+	 * PM reference of a pending reset is dropped by the USB core.
+	 */
+	cancel_delayed_work_sync(&temper_dev->sample_work);
+	temper_grid_stop(temper_dev);
+	cancel_delayed_work_sync(&temper_dev->health_work);
+	cancel_work_sync(&temper_dev->uring_work);
+	temper_uring_fail(temper_dev, -ENODEV, false);
+
+	/* Stop the transport, killing the URBs in flight */
+	mutex_lock(&temper_dev->io_mutex);
+	temper_transport_teardown(temper_dev);
+	mutex_unlock(&temper_dev->io_mutex);
+
+	/* Free the device structure, unless files are still open */
+	usb_set_intfdata(interface, NULL);
+	kref_put(&temper_dev->kref, temper_delete);
 
 	printk(KERN_INFO "TEMPer module now detached\n");
 }
@@ -213,19 +2914,42 @@ static struct usb_driver temper_driver = {
 	.name = "temper",
 	.probe = temper_probe,
 	.disconnect = temper_disconnect,
+	.pre_reset = temper_pre_reset,
+	.post_reset = temper_post_reset,
+	.suspend = temper_suspend,
+	.resume = temper_resume,
+	.reset_resume = temper_resume,
 	.id_table = temper_id_table,
+	.supports_autosuspend = 1,
 };
 
 static int __init temper_init(void)
 {
-	printk("Hello world\n");
-	return usb_register(&temper_driver);
+	int rc;
+
+	printk(KERN_INFO "temper: hello !\n");
+
+	rc = genl_register_family(&temper_nl_family);
+	if (rc)
+		return rc;
+
+	rc = usb_register(&temper_driver);
+	if (rc)
+		genl_unregister_family(&temper_nl_family);
+
+	return rc;
 }
 
 static void __exit temper_exit(void)
 {
-	printk("bye\n");
+	printk(KERN_INFO "temper: bye !\n");
 	usb_deregister(&temper_driver);
+
+	/* Send the last batch */
+	cancel_delayed_work_sync(&temper_nl_flush);
+	temper_nl_flush_work(NULL);
+
+	genl_unregister_family(&temper_nl_family);
 }
 
 module_init(temper_init);
@@ -233,4 +2957,5 @@ module_exit(temper_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Miquel Raynal <raynal.miquel@gmail.com>");
-MODULE_DESCRIPTION("TEMPer2 USB key driver, offering sysfs entries");
+MODULE_DESCRIPTION("TEMPer USB keys driver, offering sysfs entries and a char device");
+MODULE_ALIAS_GENL_FAMILY(TEMPER_NL_FAMILY_NAME);
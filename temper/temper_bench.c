@@ -0,0 +1,431 @@
+/*  temper_bench.c - Compares the latency, throughput and CPU cost of the
+ *                   temper driver ioctl path and of the hidraw backend
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "temper_uapi.h"
+#include "temper_hidraw.h"
+
+#define DEFAULT_SAMPLES 100
+#define DEFAULT_TIMEOUT 1000 /* ms */
+
+struct bench {
+	const char *name;
+	int devices;
+	unsigned int samples;
+	unsigned int done;
+	unsigned int errors;
+	unsigned int cached;
+	uint64_t *lat_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	struct rusage ru_start;
+	struct rusage ru_end;
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "\
+    Compares the ways of reading TEMPer sticks. Load the driver with\n\
+    client_rate=0, otherwise most kernel samples are served from the cache.\n\
+      -b <backend>  kernel: blocking ioctls on /dev/usb/temperN\n\
+                    uring: io_uring commands on every /dev/usb/temperN\n\
+                    hidraw: asynchronous requests on every stick\n\
+                    hidraw-sync: blocking hidraw requests\n\
+      -n <samples>  total number of samples (default %d)\n\
+      -t <ms>       hidraw timeout (default %d)\n", DEFAULT_SAMPLES,
+		DEFAULT_TIMEOUT);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t tv_us(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_begin(struct bench *b)
+{
+	getrusage(RUSAGE_SELF, &b->ru_start);
+	b->start_ns = now_ns();
+}
+
+static void bench_end(struct bench *b)
+{
+	b->end_ns = now_ns();
+	getrusage(RUSAGE_SELF, &b->ru_end);
+}
+
+static void bench_record(struct bench *b, int status, uint64_t lat_ns)
+{
+	if (status) {
+		b->errors++;
+		return;
+	}
+	b->lat_ns[b->done++] = lat_ns;
+}
+
+static void bench_report(struct bench *b)
+{
+	uint64_t cpu_us, sum = 0;
+	double elapsed;
+	unsigned int i;
+
+	elapsed = (b->end_ns - b->start_ns) / 1e9;
+	cpu_us = tv_us(&b->ru_end.ru_utime) - tv_us(&b->ru_start.ru_utime) +
+		 tv_us(&b->ru_end.ru_stime) - tv_us(&b->ru_start.ru_stime);
+
+	printf("backend:     %s\n", b->name);
+	printf("devices:     %d\n", b->devices);
+	printf("samples:     %u (errors %u, cached %u)\n", b->done, b->errors,
+	       b->cached);
+	if (!b->done)
+		return;
+
+	qsort(b->lat_ns, b->done, sizeof(*b->lat_ns), cmp_u64);
+	for (i = 0; i < b->done; i++)
+		sum += b->lat_ns[i];
+
+	printf("latency_us:  min %llu avg %llu p99 %llu max %llu\n",
+	       (unsigned long long)b->lat_ns[0] / 1000,
+	       (unsigned long long)sum / b->done / 1000,
+	       (unsigned long long)b->lat_ns[(b->done - 1) * 99 / 100] / 1000,
+	       (unsigned long long)b->lat_ns[b->done - 1] / 1000);
+	printf("throughput:  %.1f samples/s\n", b->done / elapsed);
+	printf("cpu_us:      %.1f per sample\n", (double)cpu_us / b->done);
+}
+
+static int bench_open_devices(struct bench *b, int *fds)
+{
+	glob_t g;
+	size_t i;
+
+	if (glob("/dev/usb/temper*", 0, NULL, &g))
+		return -ENODEV;
+
+	for (i = 0; i < g.gl_pathc && b->devices < TEMPER_HR_MAX_DEVICES; i++) {
+		fds[b->devices] = open(g.gl_pathv[i], O_RDWR);
+		if (fds[b->devices] >= 0)
+			b->devices++;
+	}
+	globfree(&g);
+
+	return b->devices ? 0 : -ENODEV;
+}
+
+static void bench_close_devices(struct bench *b, int *fds)
+{
+	int i;
+
+	for (i = 0; i < b->devices; i++)
+		close(fds[i]);
+}
+
+static int bench_kernel(struct bench *b)
+{
+	struct temper_sample sample;
+	int fds[TEMPER_HR_MAX_DEVICES];
+	uint64_t start;
+	unsigned int n;
+	int rc;
+
+	rc = bench_open_devices(b, fds);
+	if (rc)
+		return rc;
+
+	bench_begin(b);
+	for (n = 0; n < b->samples; n++) {
+		start = now_ns();
+		rc = ioctl(fds[n % b->devices], TEMPER_IOR_SAMPLE, &sample);
+		bench_record(b, rc < 0 ? -errno : 0, now_ns() - start);
+		if (!rc && sample.flags & TEMPER_SAMPLE_CACHED)
+			b->cached++;
+	}
+	bench_end(b);
+
+	bench_close_devices(b, fds);
+
+	return 0;
+}
+
+/* Bare io_uring, through the system calls */
+struct ring {
+	int fd;
+	unsigned int entries;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_sqe *sqes;
+	unsigned int queued;
+};
+
+static int ring_setup(struct ring *ring, unsigned int entries)
+{
+	struct io_uring_params p = { };
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->entries = p.sq_entries;
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		close(ring->fd);
+		return -ENOMEM;
+	}
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	return 0;
+}
+
+static void ring_free(struct ring *ring)
+{
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+static void ring_queue_sample(struct ring *ring, int fd, uint64_t user_data,
+			      struct temper_sample_ts *ts)
+{
+	unsigned int tail = *ring->sq_tail, idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	struct temper_uring_cmd *cmd = (struct temper_uring_cmd *)sqe->cmd;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = TEMPER_URING_CMD_SAMPLE;
+	sqe->user_data = user_data;
+	cmd->addr = (uintptr_t)ts;
+	cmd->flags = TEMPER_URING_WAIT | TEMPER_URING_TRIGGER;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/* Submit what was queued and wait for at least one completion */
+static int ring_enter(struct ring *ring)
+{
+	int rc;
+
+	rc = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+		     IORING_ENTER_GETEVENTS, NULL, 0);
+	if (rc < 0)
+		return errno == EINTR ? 0 : -errno;
+	ring->queued -= rc;
+
+	return 0;
+}
+
+static int ring_reap(struct ring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* One fresh sample in flight per device, all from one thread */
+static int bench_uring(struct bench *b)
+{
+	struct temper_sample_ts ts[TEMPER_HR_MAX_DEVICES];
+	uint64_t sent_ns[TEMPER_HR_MAX_DEVICES];
+	int fds[TEMPER_HR_MAX_DEVICES];
+	struct io_uring_cqe cqe;
+	unsigned int sent = 0;
+	struct ring ring;
+	int dev, rc;
+
+	rc = bench_open_devices(b, fds);
+	if (rc)
+		return rc;
+
+	rc = ring_setup(&ring, b->devices);
+	if (rc) {
+		bench_close_devices(b, fds);
+		return rc;
+	}
+
+	bench_begin(b);
+	for (dev = 0; dev < b->devices && sent < b->samples; dev++, sent++) {
+		sent_ns[dev] = now_ns();
+		ring_queue_sample(&ring, fds[dev], dev, &ts[dev]);
+	}
+	while (b->done + b->errors < b->samples) {
+		rc = ring_enter(&ring);
+		if (rc)
+			break;
+		while (ring_reap(&ring, &cqe)) {
+			dev = cqe.user_data;
+			bench_record(b, cqe.res < 0 ? cqe.res : 0,
+				     now_ns() - sent_ns[dev]);
+			if (sent < b->samples) {
+				sent++;
+				sent_ns[dev] = now_ns();
+				ring_queue_sample(&ring, fds[dev], dev, &ts[dev]);
+			}
+		}
+	}
+	bench_end(b);
+
+	ring_free(&ring);
+	bench_close_devices(b, fds);
+
+	return rc;
+}
+
+static void bench_hidraw_cb(const struct temper_hr_result *res, void *arg)
+{
+	bench_record(arg, res->status, res->latency_ns);
+}
+
+static int bench_hidraw(struct bench *b, unsigned int timeout_ms, int async)
+{
+	struct temper_hr_result res;
+	struct temper_hr *hr;
+	unsigned int sent = 0;
+	int dev, rc = 0;
+
+	hr = temper_hr_new(timeout_ms);
+	if (!hr)
+		return -ENOMEM;
+
+	b->devices = temper_hr_discover(hr);
+	if (b->devices <= 0) {
+		temper_hr_free(hr);
+		return -ENODEV;
+	}
+
+	bench_begin(b);
+	if (async) {
+		/* Keep every stick busy */
+		while (b->done + b->errors < b->samples) {
+			for (dev = 0; dev < b->devices && sent < b->samples; dev++)
+				if (!temper_hr_request(hr, dev))
+					sent++;
+			rc = temper_hr_dispatch(hr, timeout_ms, bench_hidraw_cb, b);
+			if (rc < 0)
+				break;
+		}
+	} else {
+		for (sent = 0; sent < b->samples; sent++) {
+			rc = temper_hr_read(hr, sent % b->devices, &res);
+			bench_record(b, rc, res.latency_ns);
+		}
+	}
+	bench_end(b);
+
+	temper_hr_free(hr);
+
+	return rc < 0 && rc != -ETIMEDOUT ? rc : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int timeout_ms = DEFAULT_TIMEOUT;
+	struct bench b = { .name = "kernel", .samples = DEFAULT_SAMPLES };
+	int opt, rc;
+
+	while ((opt = getopt(argc, argv, "b:n:t:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			b.name = optarg;
+			break;
+		case 'n':
+			b.samples = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return -EINVAL;
+		}
+	}
+
+	b.lat_ns = calloc(b.samples ? b.samples : 1, sizeof(*b.lat_ns));
+	if (!b.lat_ns)
+		return -ENOMEM;
+
+	if (!strcmp(b.name, "kernel")) {
+		rc = bench_kernel(&b);
+	} else if (!strcmp(b.name, "uring")) {
+		rc = bench_uring(&b);
+	} else if (!strcmp(b.name, "hidraw")) {
+		rc = bench_hidraw(&b, timeout_ms, 1);
+	} else if (!strcmp(b.name, "hidraw-sync")) {
+		rc = bench_hidraw(&b, timeout_ms, 0);
+	} else {
+		usage();
+		return -EINVAL;
+	}
+
+	if (rc) {
+		fprintf(stderr, "%s: %s\n", b.name, strerror(-rc));
+		return rc;
+	}
+
+	bench_report(&b);
+	free(b.lat_ns);
+
+	return 0;
+}
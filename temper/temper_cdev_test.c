@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -7,9 +8,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#define TEMPER_MAGIC 'T' 
-#define TEMPER_IOR_TIN  _IOR(TEMPER_MAGIC, 'i', int)
-#define TEMPER_IOR_TOUT _IOR(TEMPER_MAGIC, 'o', int)
+#include "temper_uapi.h"
 
 void usage()
 {
@@ -18,6 +17,10 @@ void usage()
     device driver. It takes one argument:\n\
       - 'i' for in temperature\n\
       - 'o' for out temperature\n\
+      - 's' for a full sample\n\
+      - 't' for a timestamped sample\n\
+      - 'h' for humidity (TEMPerHUM)\n\
+      - 'w' to watch samples moving by more than 0.1°C, or every minute\n\
     The result is printed.\n");
 }
 
@@ -25,15 +28,25 @@ int main(int argc, char *argv[])
 {
 	char cmd;
 	int fd, rc = 0;
-	unsigned long value = 0;
+	int value = 0;
+	struct temper_sample sample;
+	struct temper_sample_ts ts;
+	struct temper_deadband deadband = {
+		.flags = TEMPER_DEADBAND_ENABLE,
+		.deadband_mc = 100,
+		.deadband_mrh = 1000,
+		.heartbeat_ms = 60000,
+	};
 
-	if ((argc != 2) || (argv[1][0] != 'i' && argv[1][0] != 'o')) {
+	if ((argc != 2) || (argv[1][0] != 'i' && argv[1][0] != 'o' &&
+			    argv[1][0] != 's' && argv[1][0] != 'h' &&
+			    argv[1][0] != 't' && argv[1][0] != 'w')) {
 		usage();
 		return -EINVAL;
 	}
 	cmd = argv[1][0];
 	
-	fd = open("/dev/temper", O_RDWR);
+	fd = open("/dev/usb/temper0", O_RDWR);
 	if (fd < 0) {
 		return errno;
 	}
@@ -41,13 +54,60 @@ int main(int argc, char *argv[])
 	switch (cmd) {
 	case 'i':
 		rc = ioctl(fd, TEMPER_IOR_TIN, &value);
-		fprintf(stdout, "Inner temperature = %3lu.%03lu°C\n",
-			value / 1000, value % 1000);
+		fprintf(stdout, "Inner temperature = %d m°C\n", value);
 		break;
 	case 'o':
 		rc = ioctl(fd, TEMPER_IOR_TOUT, &value);
-		fprintf(stdout, "Outer temperature = %3lu.%03lu°C\n",
-			value / 1000, value % 1000);
+		fprintf(stdout, "Outer temperature = %d m°C\n", value);
+		break;
+	case 's':
+		/* -EAGAIN only comes with a sample if the device is failing */
+		memset(&sample, 0, sizeof(sample));
+		rc = ioctl(fd, TEMPER_IOR_SAMPLE, &sample);
+		if (rc < 0 && (errno != EAGAIN ||
+			       !(sample.flags & TEMPER_SAMPLE_VALID)))
+			break;
+		fprintf(stdout, "Inner temperature = %d m°C\n", sample.temp_in);
+		if (!(sample.flags & TEMPER_SAMPLE_NO_OUT))
+			fprintf(stdout, "Outer temperature = %d m°C\n",
+				sample.temp_out);
+		fprintf(stdout, "Age = %u ms%s\n", sample.age_ms,
+			(sample.flags & TEMPER_SAMPLE_STALE) ? " (stale)" : "");
+		break;
+	case 't':
+		memset(&ts, 0, sizeof(ts));
+		rc = ioctl(fd, TEMPER_IOR_SAMPLE_TS, &ts);
+		if (rc < 0 && (errno != EAGAIN ||
+			       !(ts.sample.flags & TEMPER_SAMPLE_VALID)))
+			break;
+		fprintf(stdout, "Inner temperature = %d m°C\n"
+			"Sequence = %llu\n"
+			"Monotonic = %llu ns\n"
+			"Realtime = %llu ns\n",
+			ts.sample.temp_in, (unsigned long long)ts.seq,
+			(unsigned long long)ts.timestamp_ns,
+			(unsigned long long)ts.realtime_ns);
+		if (ts.frame != TEMPER_NO_FRAME)
+			fprintf(stdout, "USB frame = %u\n", ts.frame);
+		if (ts.sample.flags & TEMPER_SAMPLE_GRID)
+			fprintf(stdout, "Grid error = %lld ns\n",
+				(long long)ts.grid_error_ns);
+		break;
+	case 'h':
+		rc = ioctl(fd, TEMPER_IOR_HUMIDITY, &value);
+		if (rc < 0)
+			break;
+		fprintf(stdout, "Humidity = %d m%%RH\n", value);
+		break;
+	case 'w':
+		/* Samples come from the driver sampler, see sample_interval_ms */
+		rc = ioctl(fd, TEMPER_IOW_DEADBAND, &deadband);
+		if (rc < 0)
+			break;
+		while (read(fd, &ts, sizeof(ts)) == sizeof(ts))
+			fprintf(stdout, "%llu: %d m°C\n",
+				(unsigned long long)ts.seq, ts.sample.temp_in);
+		rc = -errno;
 		break;
 	default:
 		fprintf(stderr, "Command not known '%c'.\n", cmd);
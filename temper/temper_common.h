@@ -0,0 +1,93 @@
+/*  temper_common.h - Helpers shared by the USB and HID drivers: sysfs
+ *                    formatting and the read ioctls
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#ifndef _TEMPER_COMMON_H
+#define _TEMPER_COMMON_H
+
+#include "linux/kernel.h"
+#include "linux/uaccess.h"
+
+#include "temper_uapi.h"
+
+/*
+ * Milli-units as a decimal number. The sign is printed apart, it is lost
+ * between -1 and 0 otherwise, but within the width of the integer part.
+ */
+static inline int temper_sprint_milli(char *buf, const char *label, int value,
+				      const char *unit)
+{
+	char units[16];
+
+	snprintf(units, sizeof(units), "%s%d", value < 0 ? "-" : "",
+		 abs(value) / 1000);
+
+	return sprintf(buf, "%s%3s.%03d%s\n", label, units, abs(value) % 1000,
+		       unit);
+}
+
+/* Contents of the temperatures file */
+static inline int temper_sprint_sample(char *buf,
+				       const struct temper_sample_ts *ts)
+{
+	const struct temper_sample *sample = &ts->sample;
+	int len;
+	u64 sec;
+	u32 nsec;
+
+	len = temper_sprint_milli(buf, "Temperature in:  ", sample->temp_in, "°C");
+	if (!(sample->flags & TEMPER_SAMPLE_NO_OUT))
+		len += temper_sprint_milli(buf + len, "Temperature out: ",
+					   sample->temp_out, "°C");
+	if (sample->flags & TEMPER_SAMPLE_HUMIDITY)
+		len += temper_sprint_milli(buf + len, "Humidity:        ",
+					   ts->humidity, "%RH");
+	if (sample->flags & TEMPER_SAMPLE_VALID) {
+		sec = div_u64_rem(ts->realtime_ns, NSEC_PER_SEC, &nsec);
+		len += sprintf(buf + len, "Timestamp:       %llu.%09u\n",
+			       sec, nsec);
+	}
+
+	return len;
+}
+
+/* Whether @cmd is one of the read ioctls, see temper_ioctl_put() */
+static inline bool temper_ioctl_is_read(unsigned int cmd)
+{
+	switch (cmd) {
+	case TEMPER_IOR_TIN:
+	case TEMPER_IOR_TOUT:
+	case TEMPER_IOR_SAMPLE:
+	case TEMPER_IOR_SAMPLE_TS:
+	case TEMPER_IOR_HUMIDITY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Copy the part of @ts a read ioctl asks for to userspace */
+static inline int temper_ioctl_put(unsigned int cmd, unsigned long arg,
+				   const struct temper_sample_ts *ts)
+{
+	switch (cmd) {
+	case TEMPER_IOR_TIN:
+		return put_user(ts->sample.temp_in, (unsigned int __user *)arg);
+	case TEMPER_IOR_TOUT:
+		return put_user(ts->sample.temp_out, (unsigned int __user *)arg);
+	case TEMPER_IOR_SAMPLE:
+		return copy_to_user((void __user *)arg, &ts->sample,
+				    sizeof(ts->sample)) ? -EFAULT : 0;
+	case TEMPER_IOR_SAMPLE_TS:
+		return copy_to_user((void __user *)arg, ts,
+				    sizeof(*ts)) ? -EFAULT : 0;
+	case TEMPER_IOR_HUMIDITY:
+		return put_user(ts->humidity, (int __user *)arg);
+	default:
+		return -EINVAL;
+	}
+}
+
+#endif /* _TEMPER_COMMON_H */
@@ -0,0 +1,871 @@
+/*  temper_exporter.c - Serves the samples of all the TEMPer sticks of the
+ *                      host to many local consumers
+ *
+ *  Samples are received from the driver's netlink multicast group when
+ *  available. Netlink only carries the samples the driver takes, so the
+ *  /dev/usb/temperN nodes that stayed quiet for a period (all of them
+ *  without netlink) are polled with the TEMPER_IOR_SAMPLE_TS ioctl, and
+ *  samples not refreshed for STALE_PERIODS periods are reported stale.
+ *  The responses are rendered by the main loop once per batch of updates
+ *  and swapped, serving a scrape is then a plain copy of a buffer.
+ *
+ *  Protocol, on a local stream socket, one request per connection:
+ *    - "GET ..." (HTTP): Prometheus text exposition format
+ *    - "B": binary snapshot, see temper_exporter.h
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "temper_uapi.h"
+#include "temper_exporter.h"
+
+#define DEFAULT_SOCKET   "/run/temper-exporter.sock"
+#define DEFAULT_INTERVAL 1000 /* ms */
+#define MAX_DEVICES      256
+#define MAX_EVENTS       64
+#define REQ_SIZE         64
+#define NL_BUF_SIZE      16384
+#define STALE_PERIODS    3
+
+/* A rendered response, freed when the last connection using it is done */
+struct response {
+	unsigned int refs;
+	size_t len;
+	char data[];
+};
+
+struct device {
+	int present;
+	unsigned int minor;
+	char name[32];
+	int fd; /* Only used when polling */
+	int have_sample;
+	uint64_t updated_ms; /* CLOCK_MONOTONIC, last sample received */
+	struct temper_exp_entry sample;
+};
+
+struct conn {
+	int fd;
+	char req[REQ_SIZE];
+	size_t req_len;
+	struct response *resp;
+	size_t sent;
+};
+
+static struct device devices[MAX_DEVICES];
+static struct response *prom_resp, *bin_resp;
+static int dirty = 1;
+
+/* Netlink state */
+static int nl_fd = -1;
+static uint16_t nl_family;
+static int nl_subscribed;
+static int use_netlink = 1;
+
+static volatile sig_atomic_t quit;
+
+static void usage(void)
+{
+	fprintf(stderr, "\
+    Serves TEMPer samples on a local socket, in Prometheus text format\n\
+    (HTTP GET) or as a binary snapshot (request 'B').\n\
+      -s <path>  socket path (default %s)\n\
+      -i <ms>    polling and discovery period (default %d)\n\
+      -n         do not use netlink, poll the devices\n", DEFAULT_SOCKET,
+		DEFAULT_INTERVAL);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Responses */
+static struct response *response_alloc(size_t len)
+{
+	struct response *resp = malloc(sizeof(*resp) + len);
+
+	if (!resp)
+		return NULL;
+
+	resp->refs = 1;
+	resp->len = 0;
+
+	return resp;
+}
+
+static struct response *response_get(struct response *resp)
+{
+	resp->refs++;
+
+	return resp;
+}
+
+static void response_put(struct response *resp)
+{
+	if (resp && !--resp->refs)
+		free(resp);
+}
+
+/* Swap the served response, connections still sending the old one keep it */
+static void response_swap(struct response **slot, struct response *resp)
+{
+	struct response *old = *slot;
+
+	*slot = resp;
+	response_put(old);
+}
+
+static size_t render_prom_body(char *buf, size_t size)
+{
+	struct device *dev;
+	size_t len = 0;
+	int i;
+
+#define PUT(...) len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+	PUT("# HELP temper_temperature_celsius Temperature measured by the stick.\n"
+	    "# TYPE temper_temperature_celsius gauge\n");
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present || !dev->have_sample)
+			continue;
+		PUT("temper_temperature_celsius{device=\"%s\",sensor=\"in\"} %s%d.%03d\n",
+		    dev->name, dev->sample.temp_in < 0 ? "-" : "",
+		    abs(dev->sample.temp_in) / 1000,
+		    abs(dev->sample.temp_in) % 1000);
+		if (dev->sample.flags & TEMPER_SAMPLE_NO_OUT)
+			continue;
+		PUT("temper_temperature_celsius{device=\"%s\",sensor=\"out\"} %s%d.%03d\n",
+		    dev->name, dev->sample.temp_out < 0 ? "-" : "",
+		    abs(dev->sample.temp_out) / 1000,
+		    abs(dev->sample.temp_out) % 1000);
+	}
+
+	PUT("# HELP temper_humidity_percent Relative humidity measured by the stick.\n"
+	    "# TYPE temper_humidity_percent gauge\n");
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present || !dev->have_sample ||
+		    !(dev->sample.flags & TEMPER_SAMPLE_HUMIDITY))
+			continue;
+		PUT("temper_humidity_percent{device=\"%s\"} %d.%03d\n",
+		    dev->name, dev->sample.humidity / 1000,
+		    dev->sample.humidity % 1000);
+	}
+
+	PUT("# HELP temper_sample_timestamp_seconds Time the sample was taken.\n"
+	    "# TYPE temper_sample_timestamp_seconds gauge\n");
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present || !dev->have_sample)
+			continue;
+		PUT("temper_sample_timestamp_seconds{device=\"%s\"} %llu.%09llu\n",
+		    dev->name,
+		    (unsigned long long)(dev->sample.timestamp_ns / 1000000000ULL),
+		    (unsigned long long)(dev->sample.timestamp_ns % 1000000000ULL));
+	}
+
+	PUT("# HELP temper_sample_sequence Sequence number of the last sample.\n"
+	    "# TYPE temper_sample_sequence counter\n");
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present || !dev->have_sample)
+			continue;
+		PUT("temper_sample_sequence{device=\"%s\"} %llu\n", dev->name,
+		    (unsigned long long)dev->sample.seq);
+	}
+
+	PUT("# HELP temper_sample_stale Whether the device is failing or went quiet.\n"
+	    "# TYPE temper_sample_stale gauge\n");
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present)
+			continue;
+		PUT("temper_sample_stale{device=\"%s\"} %d\n", dev->name,
+		    !dev->have_sample ||
+		    !!(dev->sample.flags & TEMPER_SAMPLE_STALE));
+	}
+#undef PUT
+
+	return len;
+}
+
+static void render(void)
+{
+	struct temper_exp_header *hdr;
+	struct response *resp;
+	size_t body, hlen;
+	char header[128];
+	int i, count = 0;
+
+	/* Prometheus over HTTP, sized with a first dry run */
+	body = render_prom_body(NULL, 0);
+	hlen = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", body);
+	resp = response_alloc(hlen + body + 1);
+	if (resp) {
+		memcpy(resp->data, header, hlen);
+		render_prom_body(resp->data + hlen, body + 1);
+		resp->len = hlen + body;
+		response_swap(&prom_resp, resp);
+	}
+
+	/* Binary */
+	for (i = 0; i < MAX_DEVICES; i++)
+		count += devices[i].present && devices[i].have_sample;
+
+	resp = response_alloc(sizeof(*hdr) +
+			      count * sizeof(struct temper_exp_entry));
+	if (resp) {
+		hdr = (struct temper_exp_header *)resp->data;
+		hdr->magic = TEMPER_EXP_MAGIC;
+		hdr->version = TEMPER_EXP_VERSION;
+		hdr->count = count;
+		hdr->reserved = 0;
+		resp->len = sizeof(*hdr);
+		for (i = 0; i < MAX_DEVICES; i++) {
+			if (!devices[i].present || !devices[i].have_sample)
+				continue;
+			memcpy(resp->data + resp->len, &devices[i].sample,
+			       sizeof(struct temper_exp_entry));
+			resp->len += sizeof(struct temper_exp_entry);
+		}
+		response_swap(&bin_resp, resp);
+	}
+
+	dirty = 0;
+}
+
+/* Devices, found in /sys/class/usbmisc and indexed by minor */
+static struct device *device_get(unsigned int minor)
+{
+	return minor < MAX_DEVICES ? &devices[minor] : NULL;
+}
+
+static void device_remove(struct device *dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	memset(dev, 0, sizeof(*dev));
+	dev->fd = -1;
+	dirty = 1;
+}
+
+static void discover(void)
+{
+	char path[300], buf[32];
+	unsigned int major, minor;
+	int seen[MAX_DEVICES] = { 0 };
+	struct dirent *de;
+	struct device *dev;
+	DIR *dir;
+	int fd, n, i;
+
+	dir = opendir("/sys/class/usbmisc");
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "temper", 6))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/usbmisc/%s/dev",
+			 de->d_name);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+		buf[n] = '\0';
+		if (sscanf(buf, "%u:%u", &major, &minor) != 2)
+			continue;
+
+		dev = device_get(minor);
+		if (!dev)
+			continue;
+		seen[minor] = 1;
+		if (dev->present)
+			continue;
+
+		dev->present = 1;
+		dev->minor = minor;
+		snprintf(dev->name, sizeof(dev->name), "%.31s", de->d_name);
+		dirty = 1;
+	}
+	closedir(dir);
+
+	for (i = 0; i < MAX_DEVICES; i++)
+		if (devices[i].present && !seen[i])
+			device_remove(&devices[i]);
+}
+
+static void device_update(unsigned int minor, const struct temper_exp_entry *s)
+{
+	struct device *dev = device_get(minor);
+
+	if (!dev)
+		return;
+
+	/* Samples may come before the uevent, do not wait for it */
+	if (!dev->present) {
+		dev->present = 1;
+		dev->minor = minor;
+		snprintf(dev->name, sizeof(dev->name), "temper%u", minor);
+	}
+
+	dev->sample = *s;
+	dev->have_sample = 1;
+	dev->updated_ms = now_ms();
+	dirty = 1;
+}
+
+/* Flag the samples nothing refreshed for @max_age_ms as stale */
+static void age_devices(uint64_t max_age_ms)
+{
+	uint64_t now = now_ms();
+	struct device *dev;
+	int i;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present || !dev->have_sample ||
+		    dev->sample.flags & TEMPER_SAMPLE_STALE ||
+		    now - dev->updated_ms <= max_age_ms)
+			continue;
+		dev->sample.flags |= TEMPER_SAMPLE_STALE;
+		dirty = 1;
+	}
+}
+
+/* Poll the devices with no sample for @quiet_ms (all of them with 0) */
+static void poll_devices(uint64_t quiet_ms)
+{
+	uint64_t now = now_ms();
+	struct temper_exp_entry entry;
+	struct temper_sample_ts ts;
+	struct device *dev;
+	char path[64];
+	int i, rc;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		dev = &devices[i];
+		if (!dev->present)
+			continue;
+		if (quiet_ms && dev->have_sample &&
+		    now - dev->updated_ms < quiet_ms)
+			continue;
+
+		if (dev->fd < 0) {
+			snprintf(path, sizeof(path), "/dev/usb/%s", dev->name);
+			dev->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (dev->fd < 0)
+				continue;
+		}
+
+		/* Stamped by the driver when the report completed */
+		rc = ioctl(dev->fd, TEMPER_IOR_SAMPLE_TS, &ts);
+		/* Unplugged, a stick replugged on this minor needs a new fd */
+		if (rc < 0 && errno == ENODEV) {
+			close(dev->fd);
+			dev->fd = -1;
+			continue;
+		}
+		if (rc < 0 && errno != EAGAIN)
+			continue;
+		if (!(ts.sample.flags & TEMPER_SAMPLE_VALID))
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.dev = dev->minor;
+		entry.flags = ts.sample.flags;
+		entry.seq = ts.seq;
+		entry.timestamp_ns = ts.realtime_ns;
+		entry.temp_in = ts.sample.temp_in;
+		entry.temp_out = ts.sample.temp_out;
+		entry.humidity = ts.humidity;
+		device_update(dev->minor, &entry);
+	}
+}
+
+/* Generic netlink */
+static struct nlattr *nla_next(struct nlattr *nla, int *rem)
+{
+	int len = NLA_ALIGN(nla->nla_len);
+
+	*rem -= len;
+
+	return (struct nlattr *)((char *)nla + len);
+}
+
+static int nla_ok(const struct nlattr *nla, int rem)
+{
+	return rem >= (int)sizeof(*nla) && nla->nla_len >= sizeof(*nla) &&
+	       nla->nla_len <= rem;
+}
+
+#define nla_for_each(pos, head, len, rem) \
+	for (pos = (head), rem = (len); nla_ok(pos, rem); pos = nla_next(pos, &(rem)))
+
+static void *nla_data(const struct nlattr *nla)
+{
+	return (char *)nla + NLA_HDRLEN;
+}
+
+static int nla_len(const struct nlattr *nla)
+{
+	return nla->nla_len - NLA_HDRLEN;
+}
+
+static int nl_send_getfamily(void)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		char attrs[NLA_HDRLEN + NLA_ALIGN(sizeof(TEMPER_NL_FAMILY_NAME))];
+	} req;
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	struct nlattr *nla;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = GENL_ID_CTRL;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.genl.cmd = CTRL_CMD_GETFAMILY;
+	req.genl.version = 1;
+	nla = (struct nlattr *)req.attrs;
+	nla->nla_type = CTRL_ATTR_FAMILY_NAME;
+	nla->nla_len = NLA_HDRLEN + sizeof(TEMPER_NL_FAMILY_NAME);
+	memcpy(nla_data(nla), TEMPER_NL_FAMILY_NAME, sizeof(TEMPER_NL_FAMILY_NAME));
+
+	return sendto(nl_fd, &req, sizeof(req), 0, (struct sockaddr *)&addr,
+		      sizeof(addr));
+}
+
+/* Parse the controller answer and join the samples group */
+static void nl_handle_family(struct nlattr *attrs, int len)
+{
+	struct nlattr *nla, *grp, *a;
+	int rem, grem, arem;
+	uint32_t grp_id;
+	const char *name;
+
+	nla_for_each(nla, attrs, len, rem) {
+		if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+			nl_family = *(uint16_t *)nla_data(nla);
+		if ((nla->nla_type & NLA_TYPE_MASK) != CTRL_ATTR_MCAST_GROUPS)
+			continue;
+
+		nla_for_each(grp, (struct nlattr *)nla_data(nla), nla_len(nla), grem) {
+			name = NULL;
+			grp_id = 0;
+			nla_for_each(a, (struct nlattr *)nla_data(grp), nla_len(grp), arem) {
+				if (a->nla_type == CTRL_ATTR_MCAST_GRP_NAME)
+					name = nla_data(a);
+				if (a->nla_type == CTRL_ATTR_MCAST_GRP_ID)
+					grp_id = *(uint32_t *)nla_data(a);
+			}
+			if (!name || strcmp(name, TEMPER_NL_MCGRP_SAMPLES_NAME))
+				continue;
+
+			if (setsockopt(nl_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+				       &grp_id, sizeof(grp_id)) < 0) {
+				perror("netlink membership");
+				continue;
+			}
+			nl_subscribed = 1;
+			fprintf(stderr, "temper_exporter: subscribed to netlink samples\n");
+		}
+	}
+}
+
+static void nl_handle_samples(struct nlattr *attrs, int len)
+{
+	struct temper_exp_entry entry;
+	struct nlattr *nla, *a;
+	int rem, arem;
+
+	nla_for_each(nla, attrs, len, rem) {
+		if ((nla->nla_type & NLA_TYPE_MASK) != TEMPER_NL_A_SAMPLE)
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		nla_for_each(a, (struct nlattr *)nla_data(nla), nla_len(nla), arem) {
+			switch (a->nla_type) {
+			case TEMPER_NL_S_DEV:
+				entry.dev = *(uint32_t *)nla_data(a);
+				break;
+			case TEMPER_NL_S_SEQ:
+				memcpy(&entry.seq, nla_data(a), sizeof(entry.seq));
+				break;
+			case TEMPER_NL_S_TIMESTAMP:
+				memcpy(&entry.timestamp_ns, nla_data(a),
+				       sizeof(entry.timestamp_ns));
+				break;
+			case TEMPER_NL_S_TEMP_IN:
+				entry.temp_in = *(int32_t *)nla_data(a);
+				break;
+			case TEMPER_NL_S_TEMP_OUT:
+				entry.temp_out = *(int32_t *)nla_data(a);
+				break;
+			case TEMPER_NL_S_HUMIDITY:
+				entry.humidity = *(int32_t *)nla_data(a);
+				break;
+			case TEMPER_NL_S_STATUS:
+				entry.flags = *(uint32_t *)nla_data(a);
+				break;
+			}
+		}
+		device_update(entry.dev, &entry);
+	}
+}
+
+static void nl_receive(void)
+{
+	static char buf[NL_BUF_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct genlmsghdr *genl;
+	struct nlmsghdr *nlh;
+	struct nlattr *attrs;
+	int len, alen;
+
+	for (;;) {
+		len = recv(nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			/* Samples lost on overrun are simply superseded */
+			if (errno == ENOBUFS)
+				continue;
+			return;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_ERROR ||
+			    nlh->nlmsg_type == NLMSG_DONE)
+				continue;
+
+			genl = NLMSG_DATA(nlh);
+			attrs = (struct nlattr *)((char *)genl + GENL_HDRLEN);
+			alen = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+			if (nlh->nlmsg_type == GENL_ID_CTRL &&
+			    genl->cmd == CTRL_CMD_NEWFAMILY)
+				nl_handle_family(attrs, alen);
+			else if (nl_family && nlh->nlmsg_type == nl_family &&
+				 genl->cmd == TEMPER_NL_CMD_SAMPLES)
+				nl_handle_samples(attrs, alen);
+		}
+	}
+}
+
+static int nl_open(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	int size = 1 << 20;
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		       NETLINK_GENERIC);
+	if (nl_fd < 0)
+		return -errno;
+
+	setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(nl_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(nl_fd);
+		nl_fd = -1;
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Kernel uevents, to follow plugs and unplugs without a restart */
+static int uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* Kernel events */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void uevent_receive(int fd)
+{
+	char buf[4096];
+	int len;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		buf[len] = '\0';
+		/* "action@devpath" then NUL separated KEY=value pairs */
+		if (!strstr(buf, "/usbmisc/temper") &&
+		    !strstr(buf, "/module/temper"))
+			continue;
+
+		discover();
+		/* A freshly loaded module registers the family again */
+		if (!strncmp(buf, "add@/module/", 12) && use_netlink) {
+			nl_subscribed = 0;
+			nl_send_getfamily();
+		}
+	}
+}
+
+/* Clients */
+static int listen_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void conn_close(int epfd, struct conn *c)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	response_put(c->resp);
+	free(c);
+}
+
+static void conn_accept(int epfd, int lfd)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct conn *c;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+/* Returns 1 when the connection is done */
+static int conn_write(struct conn *c)
+{
+	ssize_t n;
+
+	while (c->sent < c->resp->len) {
+		n = send(c->fd, c->resp->data + c->sent, c->resp->len - c->sent,
+			 MSG_NOSIGNAL);
+		if (n < 0)
+			return errno != EAGAIN;
+		c->sent += n;
+	}
+
+	return 1;
+}
+
+static int conn_event(int epfd, struct conn *c, uint32_t events)
+{
+	struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+	ssize_t n;
+
+	if (events & (EPOLLERR | EPOLLHUP) && !c->resp)
+		return 1;
+
+	if (c->resp)
+		return conn_write(c);
+
+	n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - c->req_len, 0);
+	if (n <= 0)
+		return n == 0 || errno != EAGAIN;
+	c->req_len += n;
+
+	if (c->req[0] == 'B') {
+		c->resp = response_get(bin_resp);
+	} else if (c->req_len >= 4 && !memcmp(c->req, "GET ", 4)) {
+		c->resp = response_get(prom_resp);
+	} else if (c->req_len < 4 && !memcmp(c->req, "GET ", c->req_len)) {
+		return 0; /* Wait for more */
+	} else {
+		return 1;
+	}
+
+	/* Most of the time the whole response fits in the socket buffer */
+	if (conn_write(c))
+		return 1;
+
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+	return 0;
+}
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	const char *path = DEFAULT_SOCKET;
+	unsigned int interval = DEFAULT_INTERVAL;
+	struct itimerspec its;
+	int epfd, lfd, ufd, tfd;
+	uint64_t ticks;
+	int i, n, opt;
+
+	while ((opt = getopt(argc, argv, "s:i:nh")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			use_netlink = 0;
+			break;
+		default:
+			usage();
+			return -EINVAL;
+		}
+	}
+	if (!interval) {
+		usage();
+		return -EINVAL;
+	}
+
+	for (i = 0; i < MAX_DEVICES; i++)
+		devices[i].fd = -1;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	lfd = listen_open(path);
+	if (epfd < 0 || lfd < 0) {
+		perror("temper_exporter");
+		return errno;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &lfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+	ufd = uevent_open();
+	if (ufd >= 0) {
+		ev.data.ptr = &ufd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, ufd, &ev);
+	} else {
+		fprintf(stderr, "temper_exporter: no uevents, relying on periodic discovery\n");
+	}
+
+	if (use_netlink && !nl_open()) {
+		ev.data.ptr = &nl_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, nl_fd, &ev);
+		nl_send_getfamily();
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	its.it_interval.tv_sec = interval / 1000;
+	its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(tfd, 0, &its, NULL);
+	ev.data.ptr = &tfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+	discover();
+	render();
+
+	while (!quit) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &lfd) {
+				conn_accept(epfd, lfd);
+			} else if (ptr == &nl_fd) {
+				nl_receive();
+			} else if (ptr == &ufd) {
+				uevent_receive(ufd);
+			} else if (ptr == &tfd) {
+				if (read(tfd, &ticks, sizeof(ticks)) < 0)
+					continue;
+				if (ufd < 0)
+					discover();
+				if (nl_fd >= 0 && !nl_subscribed)
+					nl_send_getfamily();
+				/*
+				 * Pushed samples depend on the driver sampler,
+				 * which may be off: poll the quiet devices.
+				 */
+				poll_devices(nl_subscribed ? interval : 0);
+				age_devices((uint64_t)STALE_PERIODS * interval);
+			} else if (conn_event(epfd, ptr, events[i].events)) {
+				conn_close(epfd, ptr);
+			}
+		}
+
+		/* Off the scrape path, which only copies the last rendering */
+		if (dirty)
+			render();
+	}
+
+	unlink(path);
+
+	return 0;
+}
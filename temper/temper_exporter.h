@@ -0,0 +1,36 @@
+/*  temper_exporter.h - Binary protocol of temper_exporter, for its clients
+ *
+ *  Sending "B" on the exporter socket returns a struct temper_exp_header
+ *  followed by count struct temper_exp_entry, in host endianness, then
+ *  the connection is closed.
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#ifndef _TEMPER_EXPORTER_H
+#define _TEMPER_EXPORTER_H
+
+#include <stdint.h>
+
+#define TEMPER_EXP_MAGIC   0x54455850 /* "TEXP" */
+#define TEMPER_EXP_VERSION 2
+
+struct temper_exp_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count; /* Number of entries following */
+	uint32_t reserved;
+};
+
+struct temper_exp_entry {
+	uint32_t dev; /* Minor of /dev/usb/temperN */
+	uint32_t flags; /* TEMPER_SAMPLE_* */
+	uint64_t seq;
+	uint64_t timestamp_ns; /* CLOCK_REALTIME */
+	int32_t temp_in; /* m°C */
+	int32_t temp_out; /* m°C, unless TEMPER_SAMPLE_NO_OUT */
+	int32_t humidity; /* m%RH, if TEMPER_SAMPLE_HUMIDITY */
+	uint32_t reserved;
+};
+
+#endif /* _TEMPER_EXPORTER_H */
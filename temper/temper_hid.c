@@ -0,0 +1,451 @@
+/*  temper_hid.c - Offers sysfs entries and a char device to get measured
+ *                 temperatures from the USB keys of the "TEMPer" family,
+ *                 as a HID driver
+ *
+ *  usbhid keeps the interrupt IN URB of the sensor interface posted, the
+ *  request is sent with a SET_REPORT and the answer is caught in
+ *  raw_event(). No udev rule is needed, the keyboard interface is left to
+ *  the generic HID handling.
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#include "linux/init.h"
+#include "linux/kernel.h"
+#include "linux/module.h"
+#include "linux/hid.h"
+#include "linux/usb.h"
+#include "linux/slab.h"
+#include "linux/stat.h"
+#include "linux/miscdevice.h"
+#include "linux/mutex.h"
+#include "linux/spinlock.h"
+#include "linux/completion.h"
+#include "linux/ktime.h"
+#include "linux/kref.h"
+
+#include "temper_uapi.h"
+#include "temper_models.h"
+#include "temper_common.h"
+
+#define TEMPER_SENSOR_IFNUM  1 /* Interface 0 is the keyboard emulation */
+#define TEMPER_REPORT_ANSWER 0x80 /* First byte of a temperature report */
+#define TEMPER_DRAIN_MS      100 /* Grace for the answer to a failed request */
+
+static unsigned int timeout_ms = 1000;
+module_param(timeout_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_ms, "Time given to the stick to answer a request (ms)");
+
+static char *model_name;
+module_param_named(model, model_name, charp, 0444);
+MODULE_PARM_DESC(model, "Model of the sticks with TEMPer2 IDs: TEMPer2, TEMPer1 or TEMPer1F");
+
+struct temper_hid {
+	struct hid_device *hdev;
+	struct miscdevice miscdev;
+	struct usb_device *udev;
+	const struct temper_model *model;
+	u8 *request; /* DMA-able copy of the model command */
+	/* The binding and every open file hold a reference */
+	struct kref kref;
+
+	/* Serializes the requests */
+	struct mutex io_mutex;
+	bool gone; /* Removed, written with io_mutex held */
+	struct completion answer;
+
+	/* Protects the data below, written from raw_event() */
+	spinlock_t lock;
+	bool has_sample;
+	int temp_in; /* m°C */
+	int temp_out; /* m°C */
+	int humidity; /* m%RH */
+	ktime_t last_good; /* At report completion */
+	u32 last_frame;
+	u64 seq;
+	u64 reports;
+	u64 unsolicited; /* Reports nobody was waiting for */
+	u64 late; /* Answers to requests that had given up */
+	bool waiting;
+	bool answer_due; /* A request gave up on an answer that may still come */
+};
+
+static struct hid_device_id temper_hid_id_table[] = {
+	{ HID_USB_DEVICE(0x0c45, 0x7401),
+	  .driver_data = (kernel_ulong_t)&temper_models[TEMPER_MODEL_TEMPER2] },
+	{ HID_USB_DEVICE(0x0c45, 0x7402),
+	  .driver_data = (kernel_ulong_t)&temper_models[TEMPER_MODEL_TEMPERHUM] },
+	{ HID_USB_DEVICE(0x413d, 0x2107),
+	  .driver_data = (kernel_ulong_t)&temper_models[TEMPER_MODEL_413D_2107] },
+	{ }
+};
+MODULE_DEVICE_TABLE(hid, temper_hid_id_table);
+
+/* Called from the interrupt URB completion of usbhid */
+static int temper_hid_raw_event(struct hid_device *hdev,
+				struct hid_report *report, u8 *data, int size)
+{
+	struct temper_hid *temper = hid_get_drvdata(hdev);
+	struct temper_reading reading = { };
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	bool plausible;
+	int frame;
+
+	if (!temper || size < TEMPER_REPORT_SIZE ||
+	    data[0] != TEMPER_REPORT_ANSWER)
+		return 0;
+
+	frame = usb_get_current_frame_number(temper->udev);
+
+	temper->model->decode(data, &reading);
+	plausible = temper_reading_plausible(temper->model, &reading);
+
+	spin_lock_irqsave(&temper->lock, flags);
+	temper->reports++;
+	if (plausible) {
+		temper->temp_in = reading.temp[0];
+		temper->temp_out = reading.temp[1];
+		temper->humidity = reading.humidity;
+		temper->last_good = now;
+		temper->last_frame = frame < 0 ? TEMPER_NO_FRAME : frame;
+		temper->seq++;
+		temper->has_sample = true;
+	}
+	/* The answer to a failed request comes first, it is not ours */
+	if (temper->answer_due) {
+		temper->answer_due = false;
+		temper->late++;
+		complete(&temper->answer);
+	} else if (temper->waiting) {
+		temper->waiting = false;
+		complete(&temper->answer);
+	} else {
+		temper->unsolicited++;
+	}
+	spin_unlock_irqrestore(&temper->lock, flags);
+
+	/* Let hidraw see the report too */
+	return 0;
+}
+
+/*
+ * Reports carry nothing telling which request they answer. After a
+ * request gave up, its answer may still be in flight: it is drained before
+ * the next request is sent, so that it is not taken for the new answer.
+ */
+static int temper_hid_request(struct temper_hid *temper)
+{
+	bool sent = false;
+	long left;
+	int rc;
+
+	if (mutex_lock_interruptible(&temper->io_mutex))
+		return -ERESTARTSYS;
+
+	if (temper->gone) {
+		mutex_unlock(&temper->io_mutex);
+		return -ENODEV;
+	}
+
+	if (READ_ONCE(temper->answer_due))
+		wait_for_completion_timeout(&temper->answer,
+					    msecs_to_jiffies(TEMPER_DRAIN_MS));
+
+	reinit_completion(&temper->answer);
+	spin_lock_irq(&temper->lock);
+	temper->answer_due = false;
+	temper->waiting = true;
+	spin_unlock_irq(&temper->lock);
+
+	rc = hid_hw_raw_request(temper->hdev, 0, temper->request,
+				TEMPER_REPORT_SIZE, HID_OUTPUT_REPORT,
+				HID_REQ_SET_REPORT);
+	if (rc < 0) {
+		hid_err(temper->hdev, "temper: SET_REPORT failed (%d)\n", rc);
+		goto out;
+	}
+	sent = true;
+
+	left = wait_for_completion_interruptible_timeout(&temper->answer,
+							  msecs_to_jiffies(timeout_ms));
+	if (left > 0)
+		rc = 0;
+	else if (!left)
+		rc = -ETIMEDOUT;
+	else
+		rc = left;
+
+out:
+	spin_lock_irq(&temper->lock);
+	if (temper->waiting && sent)
+		temper->answer_due = true;
+	temper->waiting = false;
+	spin_unlock_irq(&temper->lock);
+	mutex_unlock(&temper->io_mutex);
+
+	return rc;
+}
+
+static int temper_hid_get_sample(struct temper_hid *temper,
+				 struct temper_sample_ts *ts)
+{
+	struct temper_sample *sample = &ts->sample;
+	int rc;
+
+	rc = temper_hid_request(temper);
+	if (rc == -ERESTARTSYS)
+		return rc;
+
+	memset(ts, 0, sizeof(*ts));
+	spin_lock_irq(&temper->lock);
+	ts->humidity = temper->humidity;
+	ts->seq = temper->seq;
+	ts->frame = temper->has_sample ? temper->last_frame : TEMPER_NO_FRAME;
+	if (temper->has_sample) {
+		ts->timestamp_ns = ktime_to_ns(temper->last_good);
+		ts->realtime_ns = ktime_to_ns(ktime_mono_to_real(temper->last_good));
+	}
+	sample->temp_in = temper->temp_in;
+	sample->temp_out = temper->temp_out;
+	sample->age_ms = temper->has_sample ?
+		ktime_ms_delta(ktime_get(), temper->last_good) : 0;
+	sample->flags = temper->has_sample ? TEMPER_SAMPLE_VALID : 0;
+	if (temper->model->channels < 2)
+		sample->flags |= TEMPER_SAMPLE_NO_OUT;
+	if (temper->model->humidity)
+		sample->flags |= TEMPER_SAMPLE_HUMIDITY;
+	if (rc)
+		sample->flags |= TEMPER_SAMPLE_STALE;
+	spin_unlock_irq(&temper->lock);
+
+	return rc;
+}
+
+/* Sysfs */
+static ssize_t show_temperatures(struct device *dev, struct device_attribute *attr,
+				 char *buf)
+{
+	struct temper_hid *temper = hid_get_drvdata(to_hid_device(dev));
+	struct temper_sample_ts ts;
+
+	if (temper_hid_get_sample(temper, &ts) == -ERESTARTSYS)
+		return -ERESTARTSYS;
+
+	return temper_sprint_sample(buf, &ts);
+}
+static DEVICE_ATTR(temperatures, S_IRUGO, show_temperatures, NULL);
+
+static ssize_t show_reports(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct temper_hid *temper = hid_get_drvdata(to_hid_device(dev));
+	ssize_t len;
+
+	spin_lock_irq(&temper->lock);
+	len = sprintf(buf, "model: %s\nreports: %llu\nunsolicited: %llu\n"
+		      "late: %llu\n", temper->model->name, temper->reports,
+		      temper->unsolicited, temper->late);
+	spin_unlock_irq(&temper->lock);
+
+	return len;
+}
+static DEVICE_ATTR(reports, S_IRUGO, show_reports, NULL);
+
+static void temper_hid_delete(struct kref *kref)
+{
+	struct temper_hid *temper = container_of(kref, struct temper_hid, kref);
+
+	kfree(temper->miscdev.name);
+	kfree(temper->request);
+	kfree(temper);
+}
+
+/* Char device, same ioctls as the USB driver */
+static int temper_hid_open(struct inode *inode, struct file *file)
+{
+	struct temper_hid *temper = container_of(file->private_data,
+						 struct temper_hid, miscdev);
+
+	/* misc_deregister() waits for us, the device is alive */
+	kref_get(&temper->kref);
+	file->private_data = temper;
+
+	return 0;
+}
+
+static int temper_hid_release(struct inode *inode, struct file *file)
+{
+	struct temper_hid *temper = file->private_data;
+
+	kref_put(&temper->kref, temper_hid_delete);
+
+	return 0;
+}
+
+static long temper_hid_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct temper_hid *temper = file->private_data;
+	struct temper_sample_ts ts;
+	int rc;
+
+	if (READ_ONCE(temper->gone))
+		return -ENODEV;
+
+	if (!temper_ioctl_is_read(cmd)) {
+		printk(KERN_ERR "Unknown command %d\n", cmd);
+		return -EINVAL;
+	}
+	if (cmd == TEMPER_IOR_HUMIDITY && !temper->model->humidity)
+		return -EINVAL;
+
+	rc = temper_hid_get_sample(temper, &ts);
+	if (rc == -ERESTARTSYS)
+		return rc;
+	if (temper_ioctl_put(cmd, arg, &ts))
+		return -EFAULT;
+
+	/* Like the USB driver, a failed read still returns the last sample */
+	return rc ? -EAGAIN : 0;
+}
+
+static const struct file_operations temper_hid_fops = {
+	.owner = THIS_MODULE,
+	.open = temper_hid_open,
+	.release = temper_hid_release,
+	.unlocked_ioctl = temper_hid_ioctl,
+	.llseek = noop_llseek,
+};
+
+static int temper_hid_probe(struct hid_device *hdev,
+			    const struct hid_device_id *id)
+{
+	struct usb_interface *intf;
+	struct temper_hid *temper;
+	int rc;
+
+	if (!hid_is_usb(hdev))
+		return -EINVAL;
+
+	rc = hid_parse(hdev);
+	if (rc)
+		return rc;
+
+	/* Keep the keyboard interface as a plain HID device */
+	intf = to_usb_interface(hdev->dev.parent);
+	if (intf->cur_altsetting->desc.bInterfaceNumber != TEMPER_SENSOR_IFNUM)
+		return hid_hw_start(hdev, HID_CONNECT_DEFAULT);
+
+	temper = kzalloc(sizeof(*temper), GFP_KERNEL);
+	if (!temper)
+		return -ENOMEM;
+
+	temper->hdev = hdev;
+	temper->udev = interface_to_usbdev(intf);
+	temper->model = temper_model_select(
+		(const struct temper_model *)id->driver_data,
+		interface_to_usbdev(intf)->product, model_name);
+	kref_init(&temper->kref);
+	mutex_init(&temper->io_mutex);
+	spin_lock_init(&temper->lock);
+	init_completion(&temper->answer);
+
+	temper->request = kmemdup(temper->model->command, TEMPER_REPORT_SIZE,
+				  GFP_KERNEL);
+	if (!temper->request) {
+		rc = -ENOMEM;
+		goto free_temper;
+	}
+
+	temper->miscdev.minor = MISC_DYNAMIC_MINOR;
+	temper->miscdev.name = kasprintf(GFP_KERNEL, "temper_hid%d", hdev->id);
+	temper->miscdev.fops = &temper_hid_fops;
+	if (!temper->miscdev.name) {
+		rc = -ENOMEM;
+		goto free_request;
+	}
+
+	hid_set_drvdata(hdev, temper);
+
+	rc = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
+	if (rc)
+		goto free_name;
+
+	/* Have usbhid post the interrupt URB for as long as we are bound */
+	rc = hid_hw_open(hdev);
+	if (rc)
+		goto stop_hw;
+
+	rc = device_create_file(&hdev->dev, &dev_attr_temperatures);
+	if (rc)
+		goto close_hw;
+
+	rc = device_create_file(&hdev->dev, &dev_attr_reports);
+	if (rc)
+		goto remove_temperatures;
+
+	rc = misc_register(&temper->miscdev);
+	if (rc)
+		goto remove_reports;
+
+	hid_info(hdev, "temper: %s sensor bound as /dev/%s\n",
+		 temper->model->name, temper->miscdev.name);
+
+	return 0;
+
+remove_reports:
+	device_remove_file(&hdev->dev, &dev_attr_reports);
+remove_temperatures:
+	device_remove_file(&hdev->dev, &dev_attr_temperatures);
+close_hw:
+	hid_hw_close(hdev);
+stop_hw:
+	hid_hw_stop(hdev);
+free_name:
+	hid_set_drvdata(hdev, NULL);
+	kfree(temper->miscdev.name);
+free_request:
+	kfree(temper->request);
+free_temper:
+	kfree(temper);
+	return rc;
+}
+
+static void temper_hid_remove(struct hid_device *hdev)
+{
+	struct temper_hid *temper = hid_get_drvdata(hdev);
+
+	if (!temper) {
+		hid_hw_stop(hdev);
+		return;
+	}
+
+	misc_deregister(&temper->miscdev);
+	device_remove_file(&hdev->dev, &dev_attr_reports);
+	device_remove_file(&hdev->dev, &dev_attr_temperatures);
+
+	/* Files still open only get -ENODEV from now on */
+	mutex_lock(&temper->io_mutex);
+	temper->gone = true;
+	mutex_unlock(&temper->io_mutex);
+
+	hid_hw_close(hdev);
+	hid_hw_stop(hdev);
+	hid_set_drvdata(hdev, NULL);
+
+	kref_put(&temper->kref, temper_hid_delete);
+}
+
+static struct hid_driver temper_hid_driver = {
+	.name = "temper_hid",
+	.id_table = temper_hid_id_table,
+	.probe = temper_hid_probe,
+	.remove = temper_hid_remove,
+	.raw_event = temper_hid_raw_event,
+};
+module_hid_driver(temper_hid_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Miquel Raynal <raynal.miquel@gmail.com>");
+MODULE_DESCRIPTION("TEMPer HID driver, offering sysfs entries and a char device");
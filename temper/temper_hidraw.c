@@ -0,0 +1,340 @@
+/*  temper_hidraw.c - Userspace backend talking to TEMPer sticks through
+ *                    hidraw, for hosts which cannot load the driver
+ *
+ *  Writing an output report on the sensor interface makes usbhid send the
+ *  same SET_REPORT request as the driver, the stick has no interrupt OUT
+ *  endpoint. The answer comes back as an input report on the same node.
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "temper_hidraw.h"
+#include "temper_models.h"
+
+#define TEMPER_HID_PHYS   "input1" /* Sensor interface */
+#define TEMPER_REPORT_ANSWER 0x80
+
+struct temper_hr_dev {
+	int fd;
+	const struct temper_model *model;
+	/* Report number 0 (no report IDs) followed by the command */
+	uint8_t request[TEMPER_REPORT_SIZE + 1];
+	int in_flight;
+	uint64_t sent_ns;
+};
+
+struct temper_hr {
+	int epfd;
+	unsigned int timeout_ms;
+	int count;
+	int in_flight;
+	struct temper_hr_dev devs[TEMPER_HR_MAX_DEVICES];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Same decode as the drivers */
+static void temper_hr_decode(const struct temper_model *model,
+			     const uint8_t *report, struct temper_hr_result *res)
+{
+	struct temper_reading reading = { };
+
+	model->decode(report, &reading);
+	res->temp_in = reading.temp[0];
+	res->temp_out = reading.temp[1];
+	res->humidity = reading.humidity;
+}
+
+/* Model from the IDs of the node, refined with its name */
+static const struct temper_model *temper_hr_probe_model(int fd)
+{
+	const struct temper_model *model;
+	struct hidraw_devinfo info;
+	char name[256] = "";
+	char *product;
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0)
+		return NULL;
+
+	model = temper_model_lookup(info.vendor, info.product);
+	if (!model)
+		return NULL;
+
+	/* "<manufacturer> <product>" */
+	if (ioctl(fd, HIDIOCGRAWNAME(sizeof(name) - 1), name) < 0)
+		return model;
+	product = strchr(name, ' ');
+
+	return temper_model_select(model, product ? product + 1 : name,
+				   getenv("TEMPER_MODEL"));
+}
+
+struct temper_hr *temper_hr_new(unsigned int timeout_ms)
+{
+	struct temper_hr *hr = calloc(1, sizeof(*hr));
+
+	if (!hr)
+		return NULL;
+
+	hr->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (hr->epfd < 0) {
+		free(hr);
+		return NULL;
+	}
+	hr->timeout_ms = timeout_ms;
+
+	return hr;
+}
+
+void temper_hr_free(struct temper_hr *hr)
+{
+	int i;
+
+	if (!hr)
+		return;
+
+	for (i = 0; i < hr->count; i++)
+		close(hr->devs[i].fd);
+	close(hr->epfd);
+	free(hr);
+}
+
+int temper_hr_add(struct temper_hr *hr, const char *path)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	const struct temper_model *model;
+	struct temper_hr_dev *dev;
+	int fd;
+
+	if (hr->count == TEMPER_HR_MAX_DEVICES)
+		return -ENOSPC;
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	model = temper_hr_probe_model(fd);
+	if (!model) {
+		close(fd);
+		return -ENODEV;
+	}
+
+	ev.data.u32 = hr->count;
+	if (epoll_ctl(hr->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	dev = &hr->devs[hr->count];
+	memset(dev, 0, sizeof(*dev));
+	dev->fd = fd;
+	dev->model = model;
+	memcpy(&dev->request[1], model->command, TEMPER_REPORT_SIZE);
+
+	return hr->count++;
+}
+
+/*
+ * Add the sensor interface of every known stick found in /sys/class/hidraw.
+ * TEMPER_MODEL forces the model of the sticks sharing the TEMPer2 IDs.
+ */
+int temper_hr_discover(struct temper_hr *hr)
+{
+	char path[300], uevent[1024];
+	int found = 0, phys = 0;
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "hidraw", 6))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent",
+			 de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		/* The IDs are checked when opening the node */
+		phys = 0;
+		while (fgets(uevent, sizeof(uevent), f)) {
+			uevent[strcspn(uevent, "\n")] = '\0';
+			if (!strncmp(uevent, "HID_PHYS=", 9) &&
+			    strlen(uevent) > strlen(TEMPER_HID_PHYS) &&
+			    !strcmp(uevent + strlen(uevent) - strlen(TEMPER_HID_PHYS),
+				    TEMPER_HID_PHYS))
+				phys = 1;
+		}
+		fclose(f);
+		if (!phys)
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+		if (temper_hr_add(hr, path) >= 0)
+			found++;
+	}
+	closedir(dir);
+
+	return found;
+}
+
+int temper_hr_count(const struct temper_hr *hr)
+{
+	return hr->count;
+}
+
+const char *temper_hr_model(const struct temper_hr *hr, int dev)
+{
+	return dev >= 0 && dev < hr->count ? hr->devs[dev].model->name : NULL;
+}
+
+int temper_hr_fd(const struct temper_hr *hr)
+{
+	return hr->epfd;
+}
+
+int temper_hr_in_flight(const struct temper_hr *hr)
+{
+	return hr->in_flight;
+}
+
+int temper_hr_request(struct temper_hr *hr, int idx)
+{
+	uint8_t report[TEMPER_REPORT_SIZE];
+	struct temper_hr_dev *dev;
+
+	if (idx < 0 || idx >= hr->count)
+		return -EINVAL;
+
+	dev = &hr->devs[idx];
+	if (dev->in_flight)
+		return -EBUSY;
+
+	/* Drop late answers to timed out requests */
+	while (read(dev->fd, report, sizeof(report)) > 0)
+		;
+
+	if (write(dev->fd, dev->request, sizeof(dev->request)) < 0)
+		return -errno;
+
+	dev->in_flight = 1;
+	dev->sent_ns = now_ns();
+	hr->in_flight++;
+
+	return 0;
+}
+
+static void temper_hr_complete(struct temper_hr *hr, int idx, int status,
+			       const uint8_t *report, uint64_t now,
+			       temper_hr_cb cb, void *arg)
+{
+	struct temper_hr_dev *dev = &hr->devs[idx];
+	struct temper_hr_result res = {
+		.dev = idx,
+		.status = status,
+		.latency_ns = now - dev->sent_ns,
+		.timestamp_ns = now,
+	};
+
+	dev->in_flight = 0;
+	hr->in_flight--;
+
+	if (!status)
+		temper_hr_decode(dev->model, report, &res);
+	cb(&res, arg);
+}
+
+/* Returns the number of completed requests */
+int temper_hr_dispatch(struct temper_hr *hr, int timeout_ms,
+		       temper_hr_cb cb, void *arg)
+{
+	struct epoll_event events[TEMPER_HR_MAX_DEVICES];
+	uint8_t report[TEMPER_REPORT_SIZE];
+	uint64_t now, deadline;
+	struct temper_hr_dev *dev;
+	int i, n, idx, len, done = 0;
+
+	n = epoll_wait(hr->epfd, events, TEMPER_HR_MAX_DEVICES, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	now = now_ns();
+	for (i = 0; i < n; i++) {
+		idx = events[i].data.u32;
+		dev = &hr->devs[idx];
+
+		while ((len = read(dev->fd, report, sizeof(report))) > 0) {
+			if (!dev->in_flight || len < TEMPER_REPORT_SIZE ||
+			    report[0] != TEMPER_REPORT_ANSWER)
+				continue;
+			temper_hr_complete(hr, idx, 0, report, now, cb, arg);
+			done++;
+		}
+		if (len < 0 && errno != EAGAIN && dev->in_flight) {
+			temper_hr_complete(hr, idx, -errno, NULL, now, cb, arg);
+			done++;
+		}
+	}
+
+	/* Expire the requests left unanswered */
+	for (idx = 0; idx < hr->count; idx++) {
+		dev = &hr->devs[idx];
+		deadline = dev->sent_ns + hr->timeout_ms * 1000000ULL;
+		if (dev->in_flight && now >= deadline) {
+			temper_hr_complete(hr, idx, -ETIMEDOUT, NULL, now, cb, arg);
+			done++;
+		}
+	}
+
+	return done;
+}
+
+static void temper_hr_read_cb(const struct temper_hr_result *res, void *arg)
+{
+	struct temper_hr_result *out = arg;
+
+	if (res->dev == out->dev)
+		*out = *res;
+}
+
+int temper_hr_read(struct temper_hr *hr, int dev, struct temper_hr_result *res)
+{
+	int rc;
+
+	rc = temper_hr_request(hr, dev);
+	if (rc)
+		return rc;
+
+	res->dev = dev;
+	while (hr->devs[dev].in_flight) {
+		rc = temper_hr_dispatch(hr, hr->timeout_ms, temper_hr_read_cb, res);
+		if (rc < 0)
+			return rc;
+	}
+
+	return res->status;
+}
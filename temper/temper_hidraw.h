@@ -0,0 +1,51 @@
+/*  temper_hidraw.h - Userspace backend talking to TEMPer sticks through
+ *                    hidraw, for hosts which cannot load the driver
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#ifndef _TEMPER_HIDRAW_H
+#define _TEMPER_HIDRAW_H
+
+#include <stdint.h>
+
+#define TEMPER_HR_MAX_DEVICES 64
+
+struct temper_hr;
+
+struct temper_hr_result {
+	int dev; /* Index returned by temper_hr_add() */
+	int status; /* 0 or negative errno, -ETIMEDOUT if no answer */
+	int32_t temp_in; /* m°C */
+	int32_t temp_out; /* m°C, single sensor models report 0 */
+	int32_t humidity; /* m%RH, humidity models only */
+	uint64_t latency_ns; /* From the request to the answer */
+	uint64_t timestamp_ns; /* CLOCK_MONOTONIC, when the answer was read */
+};
+
+typedef void (*temper_hr_cb)(const struct temper_hr_result *res, void *arg);
+
+/* Context and devices */
+struct temper_hr *temper_hr_new(unsigned int timeout_ms);
+void temper_hr_free(struct temper_hr *hr);
+int temper_hr_add(struct temper_hr *hr, const char *path);
+int temper_hr_discover(struct temper_hr *hr);
+int temper_hr_count(const struct temper_hr *hr);
+const char *temper_hr_model(const struct temper_hr *hr, int dev);
+
+/*
+ * Asynchronous use: one request may be in flight per device, answers and
+ * timeouts are reported to the callback by temper_hr_dispatch(). The
+ * returned fd may be added to an outer poll loop.
+ */
+int temper_hr_fd(const struct temper_hr *hr);
+int temper_hr_request(struct temper_hr *hr, int dev);
+int temper_hr_in_flight(const struct temper_hr *hr);
+int temper_hr_dispatch(struct temper_hr *hr, int timeout_ms,
+		       temper_hr_cb cb, void *arg);
+
+/* Blocking helper, not to be mixed with asynchronous requests */
+int temper_hr_read(struct temper_hr *hr, int dev,
+		   struct temper_hr_result *res);
+
+#endif /* _TEMPER_HIDRAW_H */
@@ -0,0 +1,202 @@
+/*  temper_models.h - Descriptors of the sticks of the TEMPer family, shared
+ *                    by the drivers and the userspace backend
+ *
+ *  Every model answers an 8 bytes interrupt report to an 8 bytes
+ *  SET_REPORT request. Report layout, signedness and scale are folded in
+ *  one decode function per model, so decoding a sample never looks at the
+ *  model again.
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#ifndef _TEMPER_MODELS_H
+#define _TEMPER_MODELS_H
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#define TEMPER_REPORT_SIZE  8
+#define TEMPER_MAX_CHANNELS 2
+
+#define TEMPER_TEMP_MIN_MC  -40000 /* Sensor range, anything else is */
+#define TEMPER_TEMP_MAX_MC  125000 /* an implausible report */
+
+struct temper_reading {
+	int temp[TEMPER_MAX_CHANNELS]; /* m°C, inner sensor first */
+	int humidity; /* m%RH */
+};
+
+struct temper_model {
+	const char *name;
+	const char *product; /* Prefix of the USB product string, if telling */
+	unsigned short vid;
+	unsigned short pid;
+	unsigned char command[TEMPER_REPORT_SIZE];
+	unsigned int channels; /* Temperature sensors */
+	unsigned int humidity; /* Also measures relative humidity */
+	void (*decode)(const unsigned char *report, struct temper_reading *r);
+};
+
+enum temper_model_id {
+	TEMPER_MODEL_TEMPER2,
+	TEMPER_MODEL_TEMPER1,
+	TEMPER_MODEL_TEMPER1F,
+	TEMPER_MODEL_TEMPERHUM,
+	TEMPER_MODEL_413D_2107,
+	TEMPER_NR_MODELS,
+};
+
+static inline int temper_be16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/* FM75 style sensors: signed big endian, 1/256 °C */
+static inline int temper_fm75_mc(const unsigned char *p)
+{
+	return (short)temper_be16(p) * 125 / 32;
+}
+
+/* TEMPer2: inner sensor on bytes 2-3, probe on bytes 4-5 */
+static inline void temper_decode_temper2(const unsigned char *report,
+					 struct temper_reading *r)
+{
+	r->temp[0] = temper_fm75_mc(&report[2]);
+	r->temp[1] = temper_fm75_mc(&report[4]);
+}
+
+/* TEMPer1: a single sensor on bytes 2-3 */
+static inline void temper_decode_temper1(const unsigned char *report,
+					 struct temper_reading *r)
+{
+	r->temp[0] = temper_fm75_mc(&report[2]);
+}
+
+/* TEMPer1F: a single probe, reported on bytes 4-5 */
+static inline void temper_decode_temper1f(const unsigned char *report,
+					  struct temper_reading *r)
+{
+	r->temp[0] = temper_fm75_mc(&report[4]);
+}
+
+/*
+ * TEMPerHUM: SHT1x, 14 bits temperature on bytes 2-3 and 12 bits humidity
+ * on bytes 4-5, converted with the datasheet coefficients (3.5V supply),
+ * humidity compensated in temperature. Integer only, within 2 m%RH.
+ */
+static inline void temper_decode_temperhum(const unsigned char *report,
+					   struct temper_reading *r)
+{
+	int t = temper_be16(&report[2]) * 10 - 39700;
+	int so = temper_be16(&report[4]) & 0xfff;
+	int rh;
+
+	rh = -2047 + so * 367 / 10 - (so * so / 1000) * 15955 / 10000;
+	rh += (t - 25000) / 10 * (1000 + 8 * so) / 10000;
+	if (rh < 0)
+		rh = 0;
+	if (rh > 100000)
+		rh = 100000;
+
+	r->temp[0] = t;
+	r->humidity = rh;
+}
+
+/* 413d:2107 (TEMPerGold, TEMPer2 v3): signed big endian, 1/100 °C */
+static inline void temper_decode_413d(const unsigned char *report,
+				      struct temper_reading *r)
+{
+	r->temp[0] = (short)temper_be16(&report[2]) * 10;
+	r->temp[1] = (short)temper_be16(&report[4]) * 10;
+}
+
+/* A wedged stick may answer garbage rather than nothing */
+static inline int temper_reading_plausible(const struct temper_model *model,
+					   const struct temper_reading *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < model->channels; i++)
+		if (r->temp[i] < TEMPER_TEMP_MIN_MC ||
+		    r->temp[i] > TEMPER_TEMP_MAX_MC)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * TEMPer1, TEMPer1F and TEMPer2 share their IDs, only the TEMPer1F names
+ * itself in its product string.
+ */
+static const struct temper_model temper_models[TEMPER_NR_MODELS] = {
+	[TEMPER_MODEL_TEMPER2] = {
+		.name = "TEMPer2", .vid = 0x0c45, .pid = 0x7401,
+		.command = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 },
+		.channels = 2, .decode = temper_decode_temper2,
+	},
+	[TEMPER_MODEL_TEMPER1] = {
+		.name = "TEMPer1", .vid = 0x0c45, .pid = 0x7401,
+		.command = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 },
+		.channels = 1, .decode = temper_decode_temper1,
+	},
+	[TEMPER_MODEL_TEMPER1F] = {
+		.name = "TEMPer1F", .product = "TEMPer1F", .vid = 0x0c45, .pid = 0x7401,
+		.command = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 },
+		.channels = 1, .decode = temper_decode_temper1f,
+	},
+	[TEMPER_MODEL_TEMPERHUM] = {
+		.name = "TEMPerHUM", .vid = 0x0c45, .pid = 0x7402,
+		.command = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 },
+		.channels = 1, .humidity = 1, .decode = temper_decode_temperhum,
+	},
+	[TEMPER_MODEL_413D_2107] = {
+		.name = "TEMPer-413d", .vid = 0x413d, .pid = 0x2107,
+		.command = { 0x01, 0x80, 0x33, 0x01, 0x00, 0x00, 0x00, 0x00 },
+		.channels = 2, .decode = temper_decode_413d,
+	},
+};
+
+/*
+ * Refine the model matched by IDs: by name when forced by the user, else
+ * by product string.
+ */
+static inline const struct temper_model *
+temper_model_select(const struct temper_model *model, const char *product,
+		    const char *name)
+{
+	const struct temper_model *m;
+	int i;
+
+	for (i = 0; i < TEMPER_NR_MODELS; i++) {
+		m = &temper_models[i];
+		if (m->vid != model->vid || m->pid != model->pid)
+			continue;
+		if (name && name[0]) {
+			if (!strcmp(m->name, name))
+				return m;
+		} else if (m->product && product &&
+			   !strncmp(product, m->product, strlen(m->product))) {
+			return m;
+		}
+	}
+
+	return model;
+}
+
+/* First model matching the IDs */
+static inline const struct temper_model *
+temper_model_lookup(unsigned short vid, unsigned short pid)
+{
+	int i;
+
+	for (i = 0; i < TEMPER_NR_MODELS; i++)
+		if (temper_models[i].vid == vid && temper_models[i].pid == pid)
+			return &temper_models[i];
+
+	return NULL;
+}
+
+#endif /* _TEMPER_MODELS_H */
@@ -0,0 +1,364 @@
+/*  temper_stress.c - Hotplug churn harness for the temper driver: unbinds
+ *                    and binds a stick (or toggles its authorization) in a
+ *                    loop under concurrent readers, then checks that the
+ *                    driver gave back all the memory it took
+ *
+ *  Needs root and a stick bound to the temper driver.
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "temper_uapi.h"
+
+#define DRIVER_DIR      "/sys/bus/usb/drivers/temper"
+#define ALLOCATIONS     "/sys/module/temper/parameters/allocations"
+#define DEFAULT_CYCLES  100
+#define DEFAULT_READERS 4
+#define CYCLE_TIMEOUT   10000 /* ms */
+#define READER_WAIT     100 /* ms, longest wait for a sample between reads */
+
+enum churn {
+	CHURN_UNBIND, /* Driver unbind and bind */
+	CHURN_AUTHORIZE, /* Device deauthorization, like an unplug */
+};
+
+struct reader {
+	pthread_t thread;
+	int keep_open; /* Hold the file across disconnections */
+	unsigned long samples;
+	unsigned long enodev;
+	unsigned long errors;
+};
+
+static volatile int stop;
+
+static void usage(void)
+{
+	fprintf(stderr, "\
+    Unbinds and binds a TEMPer stick in a loop while readers hammer it,\n\
+    then checks the driver allocations are back to where they started.\n\
+      -i <intf>     interface, like 1-1:1.1 (default: first bound one)\n\
+      -m <mode>     unbind: driver unbind/bind (default)\n\
+                    authorize: device authorized 0/1\n\
+      -n <cycles>   number of cycles (default %d)\n\
+      -r <readers>  concurrent readers, half keep their file open (default %d)\n",
+		DEFAULT_CYCLES, DEFAULT_READERS);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int write_file(const char *path, const char *value)
+{
+	int fd, rc = 0;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, value, strlen(value)) < 0)
+		rc = -errno;
+	close(fd);
+
+	return rc;
+}
+
+static int read_file(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+	buf[n] = '\0';
+
+	return 0;
+}
+
+static int read_allocations(long *objects, long *bytes)
+{
+	char buf[64];
+	int rc;
+
+	rc = read_file(ALLOCATIONS, buf, sizeof(buf));
+	if (rc)
+		return rc;
+
+	return sscanf(buf, "%ld objects, %ld bytes", objects, bytes) == 2 ?
+	       0 : -EINVAL;
+}
+
+static int open_device(void)
+{
+	glob_t g;
+	int fd;
+
+	if (glob("/dev/usb/temper*", 0, NULL, &g))
+		return -ENODEV;
+	fd = open(g.gl_pathv[0], O_RDWR | O_NONBLOCK);
+	globfree(&g);
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void reader_account(struct reader *r, int rc)
+{
+	if (rc >= 0 || errno == EAGAIN)
+		r->samples++;
+	else if (errno == ENODEV)
+		r->enodev++;
+	else if (errno != EINTR)
+		r->errors++;
+}
+
+/*
+ * Open, read, close, or keep the file until the device goes away. Between
+ * reads, wait for the next sample or the unplug rather than spin, which
+ * would steal the CPU from the probe being measured.
+ */
+static void *reader_thread(void *arg)
+{
+	struct temper_sample_ts ts;
+	struct reader *r = arg;
+	struct pollfd pfd;
+	int fd, rc;
+
+	while (!stop) {
+		fd = open_device();
+		if (fd < 0) {
+			usleep(1000);
+			continue;
+		}
+
+		do {
+			rc = ioctl(fd, TEMPER_IOR_SAMPLE_TS, &ts);
+			reader_account(r, rc);
+			if (rc < 0 && errno == ENODEV)
+				break;
+			rc = read(fd, &ts, sizeof(ts));
+			if (rc < 0 && errno == ENODEV) {
+				r->enodev++;
+				break;
+			}
+
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, READER_WAIT) > 0 &&
+			    pfd.revents & (POLLHUP | POLLERR)) {
+				r->enodev++;
+				break;
+			}
+		} while (r->keep_open && !stop);
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Wait for @path to exist, or not */
+static int wait_path(const char *path, int present, uint64_t deadline)
+{
+	while ((access(path, F_OK) == 0) != present) {
+		if (now_ms() > deadline)
+			return -ETIMEDOUT;
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+/* First interface bound to the driver */
+static int find_interface(char *intf, size_t len)
+{
+	glob_t g;
+	int rc = -ENODEV;
+
+	if (glob(DRIVER_DIR "/*:*", 0, NULL, &g))
+		return rc;
+	if (g.gl_pathc) {
+		snprintf(intf, len, "%s", strrchr(g.gl_pathv[0], '/') + 1);
+		rc = 0;
+	}
+	globfree(&g);
+
+	return rc;
+}
+
+/*
+ * Detach then attach the interface, returns the probe to first sample
+ * time, or -1 if the stick has not answered yet
+ */
+static int churn_once(const char *intf, enum churn mode, long *first_us)
+{
+	char bound[128], path[192], dev[64], timing[2048], *end;
+	uint64_t deadline = now_ms() + CYCLE_TIMEOUT;
+	char *p;
+	int rc;
+
+	snprintf(bound, sizeof(bound), DRIVER_DIR "/%s", intf);
+	snprintf(dev, sizeof(dev), "%.*s", (int)strcspn(intf, ":"), intf);
+
+	if (mode == CHURN_UNBIND) {
+		rc = write_file(DRIVER_DIR "/unbind", intf);
+		if (!rc)
+			rc = wait_path(bound, 0, deadline);
+		if (!rc)
+			rc = write_file(DRIVER_DIR "/bind", intf);
+	} else {
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/authorized",
+			 dev);
+		rc = write_file(path, "0");
+		if (!rc)
+			rc = wait_path(bound, 0, deadline);
+		if (!rc)
+			rc = write_file(path, "1");
+	}
+	if (!rc)
+		rc = wait_path(bound, 1, deadline);
+	if (rc)
+		return rc;
+
+	/* Probe reads a first sample before returning, "none" if it failed */
+	snprintf(path, sizeof(path), "%s/timing", bound);
+	rc = read_file(path, timing, sizeof(timing));
+	if (rc)
+		return rc;
+	*first_us = -1;
+	p = strstr(timing, "probe_to_first_sample_us: ");
+	if (p) {
+		p += strlen("probe_to_first_sample_us: ");
+		*first_us = strtol(p, &end, 10);
+		if (end == p)
+			*first_us = -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int cycles = DEFAULT_CYCLES, n_readers = DEFAULT_READERS;
+	long objects, bytes, objects_end, bytes_end, first_us;
+	long first_min = -1, first_max = 0, first_sum = 0, first_n = 0;
+	unsigned long samples = 0, enodev = 0, errors = 0;
+	enum churn mode = CHURN_UNBIND;
+	struct reader *readers;
+	char intf[64] = "";
+	unsigned int i, n;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "i:m:n:r:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			snprintf(intf, sizeof(intf), "%s", optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "unbind")) {
+				mode = CHURN_UNBIND;
+			} else if (!strcmp(optarg, "authorize")) {
+				mode = CHURN_AUTHORIZE;
+			} else {
+				usage();
+				return -EINVAL;
+			}
+			break;
+		case 'n':
+			cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			n_readers = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return -EINVAL;
+		}
+	}
+
+	if (!intf[0] && find_interface(intf, sizeof(intf))) {
+		fprintf(stderr, "no interface bound to the temper driver\n");
+		return -ENODEV;
+	}
+
+	/* Nothing open yet: only the bound devices hold memory */
+	rc = read_allocations(&objects, &bytes);
+	if (rc) {
+		fprintf(stderr, "%s: %s\n", ALLOCATIONS, strerror(-rc));
+		return rc;
+	}
+
+	readers = calloc(n_readers ? n_readers : 1, sizeof(*readers));
+	if (!readers)
+		return -ENOMEM;
+	for (i = 0; i < n_readers; i++) {
+		readers[i].keep_open = i & 1;
+		pthread_create(&readers[i].thread, NULL, reader_thread,
+			       &readers[i]);
+	}
+
+	for (n = 0; n < cycles; n++) {
+		rc = churn_once(intf, mode, &first_us);
+		if (rc) {
+			fprintf(stderr, "cycle %u: %s\n", n, strerror(-rc));
+			break;
+		}
+		if (first_us < 0)
+			continue;
+		if (first_min < 0 || first_us < first_min)
+			first_min = first_us;
+		if (first_us > first_max)
+			first_max = first_us;
+		first_sum += first_us;
+		first_n++;
+	}
+
+	stop = 1;
+	for (i = 0; i < n_readers; i++) {
+		pthread_join(readers[i].thread, NULL);
+		samples += readers[i].samples;
+		enodev += readers[i].enodev;
+		errors += readers[i].errors;
+	}
+	free(readers);
+
+	if (!rc)
+		rc = read_allocations(&objects_end, &bytes_end);
+	if (rc)
+		return rc;
+
+	printf("interface:   %s\n", intf);
+	printf("cycles:      %u\n", n);
+	printf("reads:       %lu (enodev %lu, errors %lu)\n", samples, enodev,
+	       errors);
+	if (first_n)
+		printf("first_us:    min %ld avg %ld max %ld\n", first_min,
+		       first_sum / first_n, first_max);
+	printf("leaked:      %ld objects, %ld bytes\n", objects_end - objects,
+	       bytes_end - bytes);
+
+	return objects_end != objects || bytes_end != bytes || errors ?
+	       -EIO : 0;
+}
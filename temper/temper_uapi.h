@@ -0,0 +1,147 @@
+/*  temper_uapi.h - Definitions shared by the temper driver and the
+ *                  userspace tools talking to /dev/temper
+ *
+ *  Copyright (C) 2016 by Miquel Raynal
+ */
+
+#ifndef _TEMPER_UAPI_H
+#define _TEMPER_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Sample flags */
+#define TEMPER_SAMPLE_VALID (1 << 0) /* At least one good read happened */
+#define TEMPER_SAMPLE_STALE (1 << 1) /* Device is failing, last good sample */
+#define TEMPER_SAMPLE_CACHED (1 << 2) /* Client over budget, cached sample */
+#define TEMPER_SAMPLE_NO_OUT (1 << 3) /* Single sensor model, no temp_out */
+#define TEMPER_SAMPLE_HUMIDITY (1 << 4) /* See TEMPER_IOR_HUMIDITY */
+#define TEMPER_SAMPLE_GRID (1 << 5) /* Taken for a sample_grid point */
+
+struct temper_sample {
+	__s32 temp_in; /* m°C */
+	__s32 temp_out; /* m°C */
+	__u32 age_ms; /* Time elapsed since the sample was read */
+	__u32 flags;
+};
+
+/* A sample with the time it was taken, at the completion of its report */
+#define TEMPER_NO_FRAME 0xffffffff
+
+struct temper_sample_ts {
+	struct temper_sample sample;
+	__u64 seq; /* Per device, increases with every good read */
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC */
+	__u64 realtime_ns; /* Same instant, CLOCK_REALTIME */
+	__u32 frame; /* USB frame number, or TEMPER_NO_FRAME */
+	__s32 humidity; /* m%RH, if TEMPER_SAMPLE_HUMIDITY */
+	__s64 grid_error_ns; /* If TEMPER_SAMPLE_GRID, completion - grid point */
+};
+
+/*
+ * Change-only delivery. read() returns one struct temper_sample_ts per
+ * call, and poll() reports it, for every sample the device takes. With
+ * TEMPER_DEADBAND_ENABLE, a sample is only delivered if a value moved by
+ * more than the dead-band since the last delivered sample, or if
+ * heartbeat_ms passed since then (0 for no heartbeat).
+ */
+#define TEMPER_DEADBAND_ENABLE (1 << 0)
+
+struct temper_deadband {
+	__u32 flags;
+	__u32 deadband_mc; /* m°C, on temp_in and temp_out */
+	__u32 deadband_mrh; /* m%RH, on humidity */
+	__u32 heartbeat_ms;
+};
+
+/*
+ * io_uring: IORING_OP_URING_CMD on /dev/usb/temperN, struct temper_uring_cmd
+ * in the SQE command area.
+ *
+ * TEMPER_URING_CMD_SAMPLE copies one struct temper_sample_ts to addr. By
+ * default, the last sample is returned right away. With TEMPER_URING_WAIT
+ * the command completes when the device takes its next sample, and with
+ * TEMPER_URING_TRIGGER that sample is read on purpose rather than left to
+ * the sampler, a failed read completing the command with an error.
+ * Triggers share the budget of the file with the read ioctls: over
+ * budget, the last sample is returned right away with
+ * TEMPER_SAMPLE_CACHED, or the command waits for the next sample if there
+ * is none yet.
+ *
+ * TEMPER_URING_CMD_HISTORY copies the last count samples at most to addr,
+ * newest first, and completes with the number of records copied.
+ */
+#define TEMPER_HISTORY_SIZE 64
+
+#define TEMPER_URING_WAIT    (1 << 0)
+#define TEMPER_URING_TRIGGER (1 << 1)
+
+struct temper_uring_cmd {
+	__u64 addr;
+	__u32 count; /* Records, TEMPER_URING_CMD_HISTORY only */
+	__u32 flags; /* TEMPER_URING_*, TEMPER_URING_CMD_SAMPLE only */
+};
+
+/* Per open file accounting */
+struct temper_client_stats {
+	__u64 requests; /* Samples asked for */
+	__u64 transactions; /* Served by a USB transaction */
+	__u64 cached; /* Over budget, served from the cache */
+	__u64 throttled; /* Over budget with no cache, delayed or -EAGAIN */
+};
+
+#define TEMPER_MAGIC 'T'
+#define TEMPER_IOR_TIN    _IOR(TEMPER_MAGIC, 'i', int)
+#define TEMPER_IOR_TOUT   _IOR(TEMPER_MAGIC, 'o', int)
+#define TEMPER_IOR_SAMPLE _IOR(TEMPER_MAGIC, 's', struct temper_sample)
+#define TEMPER_IOR_CLIENT_STATS _IOR(TEMPER_MAGIC, 'c', struct temper_client_stats)
+#define TEMPER_IOR_HUMIDITY _IOR(TEMPER_MAGIC, 'h', int) /* m%RH */
+#define TEMPER_IOR_SAMPLE_TS _IOR(TEMPER_MAGIC, 't', struct temper_sample_ts)
+#define TEMPER_IOW_DEADBAND _IOW(TEMPER_MAGIC, 'd', struct temper_deadband)
+
+/* io_uring command opcodes */
+#define TEMPER_URING_CMD_SAMPLE _IOR(TEMPER_MAGIC, 0x80, struct temper_sample_ts)
+#define TEMPER_URING_CMD_HISTORY _IOR(TEMPER_MAGIC, 0x81, struct temper_sample_ts)
+
+/*
+ * Generic netlink: every sample is multicast on the "samples" group of
+ * the "temper" family, as TEMPER_NL_CMD_SAMPLES messages carrying one or
+ * more nested TEMPER_NL_A_SAMPLE attributes.
+ */
+#define TEMPER_NL_FAMILY_NAME        "temper"
+#define TEMPER_NL_VERSION            1
+#define TEMPER_NL_MCGRP_SAMPLES_NAME "samples"
+
+enum temper_nl_commands {
+	TEMPER_NL_CMD_UNSPEC,
+	TEMPER_NL_CMD_SAMPLES,
+	__TEMPER_NL_CMD_MAX,
+};
+#define TEMPER_NL_CMD_MAX (__TEMPER_NL_CMD_MAX - 1)
+
+enum temper_nl_attrs {
+	TEMPER_NL_A_UNSPEC,
+	TEMPER_NL_A_PAD,
+	TEMPER_NL_A_SAMPLE, /* Nested, TEMPER_NL_S_* */
+	__TEMPER_NL_A_MAX,
+};
+#define TEMPER_NL_A_MAX (__TEMPER_NL_A_MAX - 1)
+
+enum temper_nl_sample_attrs {
+	TEMPER_NL_S_UNSPEC,
+	TEMPER_NL_S_PAD,
+	TEMPER_NL_S_DEV, /* u32, minor of /dev/usb/temperN */
+	TEMPER_NL_S_SEQ, /* u64, per device, gaps mean lost samples */
+	TEMPER_NL_S_TIMESTAMP, /* u64, CLOCK_REALTIME ns, at report completion */
+	TEMPER_NL_S_TEMP_IN, /* s32, m°C */
+	TEMPER_NL_S_TEMP_OUT, /* s32, m°C */
+	TEMPER_NL_S_STATUS, /* u32, TEMPER_SAMPLE_* flags */
+	TEMPER_NL_S_HUMIDITY, /* s32, m%RH, humidity models only */
+	TEMPER_NL_S_MONOTONIC, /* u64, CLOCK_MONOTONIC ns, same instant */
+	TEMPER_NL_S_FRAME, /* u32, USB frame number, if known */
+	TEMPER_NL_S_GRID_ERROR, /* s64, ns, if TEMPER_SAMPLE_GRID */
+	__TEMPER_NL_S_MAX,
+};
+#define TEMPER_NL_S_MAX (__TEMPER_NL_S_MAX - 1)
+
+#endif /* _TEMPER_UAPI_H */